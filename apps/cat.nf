@@ -4,7 +4,7 @@
 
 \ global variables
 
-32 "size" var
+4096 "size" var
 0 "buf" var
 -1 "fd_in" var
 -1 "fd_out" var
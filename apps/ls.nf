@@ -4,8 +4,9 @@
 
 \ global variables
 
-48 "file_info_size" var
+56 "file_info_size" var
 12 "file_info_name_ofs" var
+896 "buf_size" var
 -1 "fd" var
 0 "buf" var
 0 "count" var
@@ -27,7 +28,7 @@ then
 
 \ allocate buffer
 
-file_info_size sys-malloc "buf" :=
+buf_size sys-malloc "buf" :=
 buf 0 == if -1 ls-exit then
 
 \ open directory
@@ -37,11 +38,18 @@ fd 0 < if -1 ls-exit then
 
 \ FIXME: check if the file is a directory
 
-\ iterate over directory entries
+\ iterate over directory entries, reading up to 16 of them at once
 
 do
-	file_info_size buf fd sys-read "count" :=
+	buf_size buf fd sys-read "count" :=
 	count 0 == if 0 ls-exit then
-	count file_info_size != if -1 ls-exit then
-	buf file_info_name_ofs + "- %s\n" printf drop
+	count 0 < if -1 ls-exit then
+
+	0 do
+		dup count <
+	while
+		dup buf + file_info_name_ofs + "- %s\n" printf drop
+		file_info_size +
+	repeat
+	drop
 0 until
@@ -11,12 +11,19 @@ config['QEMU'] = 'qemu-system-x86_64'
 config['BASE_DIR'] = os.path.dirname(sys.argv[0])
 config['BUILD_DIR'] = os.path.join(config['BASE_DIR'], 'build')
 config['MOUNT_DIR'] = os.path.join(config['BASE_DIR'], 'tmp', 'mnt')
+config['MKROMFS'] = os.path.join(config['BASE_DIR'], 'misc', 'mkromfs.py')
 
 config['DISK_IMAGE'] = os.path.join(config['BUILD_DIR'], 'disk.img')
 config['DISK_FS_OFFSET'] = 1048576
 config['LOOP_DEVICE'] = '/dev/loop20'
 config['SERIAL_OUT'] = os.path.join(config['BASE_DIR'], 'tmp', 'serial.out')
 
+# alignment of large file data in romfs images
+config['ROMFS_ALIGN'] = 4096
+
+# compress files in the data image at least this large (0 disables)
+config['ROMFS_COMPRESS'] = 65536
+
 config['CFLAGS'] = (
     "-std=c11 -march=x86-64 -mcmodel=large -mno-red-zone -mno-mmx -mno-sse " \
     "-mno-sse2 -ffreestanding -Wall -Wextra -pedantic -Wno-unused-parameter " \
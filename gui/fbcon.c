@@ -42,25 +42,35 @@ static uint32_t fbcon_palette[] = {
 static uint32_t fbcon_buf[FBCON_WIDTH * FBCON_HEIGHT];
 static int fbcon_wd;
 
-/* redraw the terminal buffer */
+/* scroll the window contents and redraw changed cells of the terminal */
 void
-fbcon_flush(uint16_t *tbuf, int cols, int rows)
+fbcon_flush(int cols, int rows, int scroll, struct vt_damage *dmg, int count)
 {
-    int i, j, linew;
+    int i, k, linew, lines;
     uint8_t ch;
     uint32_t fg, bg;
     uint32_t *gbufp;
     uint16_t *tbufp;
     int fg_idx, bg_idx;
 
-    memset(fbcon_buf, 0, sizeof(fbcon_buf));
-
     linew = FONT_WIDTH * VT_COLS;
-    tbufp = tbuf;
-    gbufp = fbcon_buf;
 
-    for (j = 0; j < rows; ++j) {
-        for (i = 0; i < cols; ++i) {
+    lines = linew * FONT_HEIGHT;
+
+    // move the lines still visible, the uncovered ones are in the damage list
+    if (scroll > 0 && scroll < rows) {
+        memmove(fbcon_buf, fbcon_buf + scroll * lines,
+                (rows - scroll) * lines * sizeof(fbcon_buf[0]));
+    } else if (scroll < 0 && scroll > -rows) {
+        memmove(fbcon_buf - scroll * lines, fbcon_buf,
+                (rows + scroll) * lines * sizeof(fbcon_buf[0]));
+    }
+
+    for (k = 0; k < count; ++k) {
+        tbufp = dmg[k].cells + dmg[k].first;
+        gbufp = fbcon_buf + dmg[k].row * lines + dmg[k].first * FONT_WIDTH;
+
+        for (i = dmg[k].first; i < dmg[k].last; ++i) {
             ch = *tbufp & 0xFF;
             fg_idx = (*tbufp >> 8) & 0x0F;
             bg_idx = (*tbufp >> 8) & 0xF0;
@@ -73,7 +83,6 @@ fbcon_flush(uint16_t *tbuf, int cols, int rows)
             tbufp++;
             gbufp += FONT_WIDTH;
         }
-        gbufp += linew * (FONT_HEIGHT - 1);
     }
 
     gui_redraw();
@@ -23,12 +23,16 @@ static uint8_t font_buffer[FONT_HEIGHT * FONT_LENGTH];
 static void
 font_load(void)
 {
+    struct file_info info;
     ssize_t size;
     int fd;
 
     fd = vfs_open(FONT_PATH);
     kassert(fd >= 0, "cannot open font file");
 
+    kassert(!file_stat(fd, &info) && info.size == sizeof(font_buffer),
+            "invalid font file size");
+
     size = file_read(fd, font_buffer, sizeof(font_buffer));
     kassert(size == sizeof(font_buffer), "error reading font file");
 
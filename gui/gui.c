@@ -24,20 +24,24 @@ static uint32_t gui_bg_buffer[GUI_WIDTH * GUI_HEIGHT];
 void
 gui_set_bg(const char *path)
 {
+    struct file_info info;
+    uint16_t dim[2];
     int fd;
-    uint16_t w, h;
 
     fd = vfs_open(path);
     if (fd < 0)
         return;
 
-    w = h = 0;
-    (void)file_read(fd, &w, sizeof(w));
-    (void)file_read(fd, &h, sizeof(h));
-    if (w != GUI_WIDTH || h != GUI_HEIGHT)
+    // check size and dimensions before touching the current background
+    dim[0] = dim[1] = 0;
+    if (file_stat(fd, &info) || info.size != sizeof(dim) + sizeof(gui_bg_buffer) ||
+        file_pread(fd, dim, sizeof(dim), 0) != sizeof(dim) ||
+        dim[0] != GUI_WIDTH || dim[1] != GUI_HEIGHT) {
+        (void)file_close(fd);
         return;
+    }
 
-    (void)file_read(fd, gui_bg_buffer, sizeof(gui_bg_buffer));
+    (void)file_pread(fd, gui_bg_buffer, sizeof(gui_bg_buffer), sizeof(dim));
     (void)file_close(fd);
 
     gui_redraw();
@@ -12,6 +12,7 @@
 /* window object */
 struct win {
     uint8_t active;
+    array_index_t next_free;
     uint16_t x, y, w, h;
     uint32_t *buf;
 };
@@ -22,6 +23,7 @@ static void win_draw(uint32_t *buf, struct win *win);
 
 /* array of windows */
 static struct win windows[8];
+static ARRAY_POOL_HEAD(windows);
 
 /* alpha-blend two pairs of pixels */
 static inline uint64_t
@@ -77,7 +79,7 @@ win_create(int x, int y, int w, int h, uint32_t *buf)
 {
     struct win *win;
 
-    win = ARRAY_TAKE(windows);
+    win = ARRAY_POOL_TAKE(windows);
     if (!win) {
         return -1;
     }
@@ -97,8 +99,12 @@ win_close(int wd)
 {
     struct win *win;
 
+    if (!ARRAY_CHECK_INDEX(windows, wd)) {
+        return -1;
+    }
+
     win = &windows[wd];
-    ARRAY_RELEASE(win);
+    ARRAY_POOL_RELEASE(windows, win);
 
     return 0;
 }
@@ -107,5 +113,5 @@ win_close(int wd)
 void
 win_init(void)
 {
-    ARRAY_INIT(windows);
+    ARRAY_POOL_INIT(windows);
 }
@@ -19,7 +19,8 @@ enum {
 void bar_init(void);
 
 /* gui/fbcon.c */
-void fbcon_flush(uint16_t *buf, int cols, int rows);
+struct vt_damage;
+void fbcon_flush(int cols, int rows, int scroll, struct vt_damage *dmg, int count);
 void fbcon_init(void);
 
 /* gui/font.c */
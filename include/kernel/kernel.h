@@ -28,6 +28,7 @@ enum {
 /* virtual base addresses */
 enum {
     KHEAP_BASE_ADDR     = 0x4000000,  // 64MB
+    TMPFS_BASE_ADDR     = 0x20000000, // 512MB
     VID_PAGE_ADDR       = 0x3e800000, // 1000MB
 };
 
@@ -35,6 +36,7 @@ enum {
 enum {
     VT_COLS     = 80,
     VT_ROWS     = 25,
+    VT_COUNT    = 4,            // number of virtual consoles
 };
 
 /* misc gui parameters */
@@ -57,6 +59,50 @@ enum {
     KERN_ERR    = 4,
 };
 
+/* kernel log subsystems, each has its own printk threshold */
+enum {
+    KLOG_SYS_KERNEL = 0,
+    KLOG_SYS_MEM    = 1,
+    KLOG_SYS_BLK    = 2,
+    KLOG_SYS_FS     = 3,
+    KLOG_SYS_COUNT  = 4,
+};
+
+/* longest message formatted by printk */
+enum {
+    KLOG_LINE_MAX = 1024,
+};
+
+/* file seek origins */
+enum {
+    SEEK_SET    = 0,
+    SEEK_CUR    = 1,
+    SEEK_END    = 2,
+};
+
+/* file readiness events, POLL_HUP and POLL_ERR are always reported */
+enum {
+    POLL_IN     = 0x01,     // reading won't block or return nothing
+    POLL_OUT    = 0x02,     // writing won't block
+    POLL_HUP    = 0x04,     // the other end went away
+    POLL_ERR    = 0x08,     // not an open descriptor
+};
+
+/* file access advice */
+enum {
+    FILE_ADV_NORMAL     = 0,    // detect sequential access
+    FILE_ADV_SEQUENTIAL = 1,    // read ahead with the largest window
+    FILE_ADV_RANDOM     = 2,    // don't read ahead
+    FILE_ADV_WILLNEED   = 3,    // start fetching a range now
+    FILE_ADV_DONTNEED   = 4,    // a range won't be needed soon
+};
+
+/* block device parameters */
+enum {
+    BLK_SECTOR_SIZE     = 512,
+    BLK_SIZE            = 4096,
+};
+
 /* supported interrupt count */
 enum {
     INTR_COUNT  = 0x40,
@@ -72,6 +118,20 @@ enum {
     FT_UNK      = 5
 };
 
+/* vfs open flags */
+enum {
+    VFS_CREATE  = 0x01,     // create a missing file if the filesystem allows
+};
+
+/* asynchronous i/o operations */
+enum {
+    AIO_OP_NOP      = 0,
+    AIO_OP_READ     = 1,
+    AIO_OP_WRITE    = 2,
+    AIO_OP_OPEN     = 3,
+    AIO_OP_CLOSE    = 4,
+};
+
 /*
  * misc helper macros
  */
@@ -80,11 +140,37 @@ enum {
 #define BOCHS_MAGIC_BREAK                               \
      __asm__("xchgw %bx, %bx")
 
+/* lowest printk level compiled in, build with -DPRINTK_MIN_LEVEL=n to raise it */
+#ifndef PRINTK_MIN_LEVEL
+#define PRINTK_MIN_LEVEL    KERN_DEBUG
+#endif
+
+/* subsystem of the printk calls in a file, define it before including this */
+#ifndef KLOG_SUBSYS
+#define KLOG_SUBSYS         KLOG_SYS_KERNEL
+#endif
+
+/*
+ * print a kernel message. calls below the compile time level are removed,
+ * messages below the threshold of the subsystem aren't even formatted.
+ * errors always pass
+ */
+#define printk(level, ...)                                              \
+    do {                                                                \
+        if ((level) >= KERN_ERR || ((level) >= PRINTK_MIN_LEVEL &&      \
+                                    klog_enabled(KLOG_SUBSYS, level))) { \
+            kprintf(level, __VA_ARGS__);                                \
+        }                                                               \
+    } while (0)
+
 /* display an error and stop the kernel */
 #define kpanic(msg)                                     \
     {                                                   \
         cpu_cli();                                      \
         printk(KERN_ERR, msg);                          \
+        klog_sync();                                    \
+        vt_sync();                                      \
+        uart_sync();                                    \
         while(1);                                       \
     }                                                   \
 
@@ -113,33 +199,178 @@ struct intr_stack {
     uint64_t rsp;
 };
 
-/* vfs operations */
+/*
+ * vfs operations, lookup_fn and create_fn are optional. create_fn makes
+ * a new entry in a given directory when opening a missing file with
+ * VFS_CREATE, paths ending with a slash ask for a directory
+ */
+struct file_info;
 struct vfs_ops {
     int (*open_fn)(uintptr_t sbh, uintptr_t inh);
+    int (*lookup_fn)(uintptr_t sbh, uintptr_t inh, const char *name,
+                     struct file_info *dest);
+    int (*create_fn)(uintptr_t sbh, uintptr_t inh, const char *name,
+                     int type, struct file_info *dest);
 };
 
-/* file operations */
+/*
+ * file operations, the ones after write_fn are optional. map_fn returns
+ * a pointer to up to nbyte bytes of data at the current position,
+ * without copying nor consuming them, or -1 if they can't stay in place
+ * until the caller is done with them. poll_fn returns POLL_* events the
+ * file is ready for, files without it are always ready to read and write.
+ * advise_fn gets FILE_ADV_WILLNEED and FILE_ADV_DONTNEED hints for a range
+ * and must not wait for the data
+ */
 struct file;
 struct file_ops {
     int (*close_fn)(struct file *file);
     ssize_t (*read_fn)(struct file *file, void *buf, size_t nbyte);
     ssize_t (*write_fn)(struct file *file, const void *buf, size_t nbyte);
+    int (*stat_fn)(struct file *file, struct file_info *info);
+    int (*seek_fn)(struct file *file, size_t pos);
+    ssize_t (*pread_fn)(struct file *file, void *buf, size_t nbyte, size_t off);
+    ssize_t (*pwrite_fn)(struct file *file, const void *buf, size_t nbyte, size_t off);
+    ssize_t (*map_fn)(struct file *file, const void **addr, size_t nbyte);
+    int (*poll_fn)(struct file *file);
+    int (*advise_fn)(struct file *file, size_t off, size_t len, int advice);
 };
 
-/* file object  */
+/* file object, shared by all descriptors referring to it */
 struct file {
     uint8_t active;
+    array_index_t next_free;
+    uint32_t refs;
     uintptr_t sbh;
     uintptr_t inh;
     struct file_ops *ops;
     size_t pos;
+
+    int advice;                     // FILE_ADV_NORMAL, SEQUENTIAL or RANDOM
+    size_t ra_next;                 // offset expected from a sequential reader
+    size_t ra_end;                  // end of the range already advised
+    size_t ra_window;
+};
+
+/* file descriptor table slot, free slots form a list */
+struct fd_slot {
+    struct file *file;
+    int next_free;
+};
+
+/* file descriptor table of a task, the first slots are stored inline */
+enum {
+    FDTABLE_INLINE = 8,
 };
 
-/* file info object */
+struct fdtable {
+    struct fd_slot *slots;
+    int size;
+    int free;
+    struct fd_slot inline_slots[FDTABLE_INLINE];
+};
+
+/* descriptor polled by file_poll() */
+struct poll_fd {
+    int fd;
+    int events;
+    int revents;
+};
+
+/* file info object, also a directory entry returned by reading directories */
 struct file_info {
     uintptr_t inh;
     int type;
     char name[NAME_MAX];
+    size_t size;
+};
+
+/*
+ * block device request, completed by the driver with blk_complete().
+ * buf must be physically contiguous
+ */
+struct blk_req {
+    int dev;
+    int write;
+    uint64_t sector;
+    size_t count;
+    void *buf;
+    int status;
+    void (*done_fn)(struct blk_req *req);
+    void *priv;
+    struct blk_req *next;
+};
+
+/*
+ * block device driver operations. submit_fn may queue a request and
+ * complete it later, kick_fn (optional) starts processing of all queued
+ * requests. both are called with interrupts disabled
+ */
+struct blk_ops {
+    int (*submit_fn)(uintptr_t drvh, struct blk_req *req);
+    void (*kick_fn)(uintptr_t drvh);
+};
+
+/* block device counters */
+struct blk_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;
+    uint64_t read_bytes;
+    uint64_t read_msecs;
+    uint64_t write_bytes;
+    uint64_t write_msecs;
+};
+
+/* buffer cache entry, holding a single block of a device */
+struct blk_buf {
+    int dev;
+    uint64_t blkno;
+    uint8_t *data;
+
+    uint32_t refs;
+    uint8_t valid;
+    uint8_t dirty;
+    uint8_t busy;
+    uint64_t started;
+
+    array_index_t next_hash;
+    array_index_t lru_prev;
+    array_index_t lru_next;
+
+    struct blk_req req;
+};
+
+/*
+ * asynchronous i/o request. a negative offset reads or writes at the file
+ * position, requests at an offset don't move it
+ */
+struct aio_sqe {
+    int op;
+    int fd;
+    const char *path;               // for AIO_OP_OPEN
+    int flags;                      // VFS_* flags for AIO_OP_OPEN
+    void *buf;
+    size_t nbyte;
+    ssize_t off;
+    uint64_t user;                  // passed back in the completion
+};
+
+/* asynchronous i/o completion */
+struct aio_cqe {
+    uint64_t user;
+    ssize_t res;
+};
+
+/* pci device location and basic configuration */
+struct pci_dev {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint8_t irq;
+    uint16_t vendor;
+    uint16_t device;
+    uint32_t bar[6];
 };
 
 /* time object */
@@ -152,20 +383,68 @@ struct time {
     uint16_t year;
 };
 
+/*
+ * span of changed cells in a screen row. the flush callback gets a list of
+ * them, to draw after moving the screen contents up by scroll lines, or
+ * down if scroll is negative
+ */
+struct vt_damage {
+    uint16_t *cells;                // all cells of the row
+    uint8_t row;
+    uint8_t first;                  // first changed column
+    uint8_t last;                   // one past the last changed column
+};
+
 /*
  * shared functions
  */
 
 
+/* kernel/aio.c */
+void aio_init(void);
+int aio_setup(void);
+struct aio_sqe *aio_get_sqe(int ring);
+int aio_submit(int ring);
+int aio_peek(int ring, struct aio_cqe *cqe);
+int aio_wait(int ring, struct aio_cqe *cqe);
+void aio_destroy(int ring);
+void aio_task_exit(void);
+
+/* kernel/ata.c */
+void ata_init(void);
+
+/* kernel/blkdev.c */
+void blk_init(void);
+int blk_register(const char *name, struct blk_ops *ops, uintptr_t drvh,
+                 uint64_t sectors);
+int blk_find(const char *name);
+uint64_t blk_size(int dev);
+void blk_complete(struct blk_req *req, int status);
+struct blk_buf *blk_get(int dev, uint64_t blkno);
+void blk_put(struct blk_buf *buf);
+void blk_dirty(struct blk_buf *buf);
+ssize_t blk_read(int dev, void *buf, size_t nbyte, uint64_t off);
+ssize_t blk_write(int dev, const void *buf, size_t nbyte, uint64_t off);
+void blk_prefetch(int dev, uint64_t off, size_t nbyte);
+int blk_sync(int dev);
+size_t blk_stats_print(char *buf, size_t size);
+
 /* kernel/cmos.c */
 void cmos_get_time(struct time *t);
 
 /* kernel/cpu.c */
 uint8_t cpu_inb(uint16_t port);
 void cpu_outb(uint16_t port, uint8_t val);
+uint16_t cpu_inw(uint16_t port);
+void cpu_outw(uint16_t port, uint16_t val);
+uint32_t cpu_inl(uint16_t port);
+void cpu_outl(uint16_t port, uint32_t val);
+void cpu_insw(uint16_t port, void *buf, size_t count);
+void cpu_outsw(uint16_t port, const void *buf, size_t count);
 void cpu_invlpg(uint64_t vaddr);
 void cpu_cli(void);
 void cpu_sti(void);
+void cpu_idle(void);
 uint64_t cpu_task_switch(void);
 uint64_t cpu_get_flags(void);
 void cpu_set_flags(uint64_t flags);
@@ -177,12 +456,27 @@ uint16_t crtc_cursor_get(void);
 /* kernel/devfs.c */
 int devfs_mount(const char *path);
 
+/* kernel/ext2.c */
+int ext2_mount(const char *devname, const char *volume);
+
 /* kernel/file.c */
+void fdtable_init(struct fdtable *fdt);
+void fdtable_copy(struct fdtable *dst, struct fdtable *src);
+void fdtable_close_all(struct fdtable *fdt);
 int file_new(uintptr_t sbh, uintptr_t inh, struct file_ops *ops);
 void file_release(struct file *file);
+int file_dup(int fd);
 int file_close(int fd);
 ssize_t file_read(int fd, void *buf, size_t nbyte);
 ssize_t file_write(int fd, void *buf, size_t nbyte);
+int file_stat(int fd, struct file_info *info);
+ssize_t file_seek(int fd, ssize_t off, int whence);
+ssize_t file_pread(int fd, void *buf, size_t nbyte, size_t off);
+ssize_t file_pwrite(int fd, const void *buf, size_t nbyte, size_t off);
+ssize_t file_splice(int fd_in, int fd_out, size_t nbyte);
+int file_poll(struct poll_fd *fds, size_t count, int timeout);
+int file_advise(int fd, size_t off, size_t len, int advice);
+void file_poll_wakeup(void);
 void files_init(void);
 
 /* kernel/intr.c */
@@ -195,6 +489,7 @@ void intr_handle(uint8_t intno, struct intr_stack *intr_stack, struct regs *regs
 /* kernel/kbd.c */
 void kbd_init(void);
 int kbd_read(uint16_t *key);
+int kbd_pending(void);
 
 /* kernel/kheap.c */
 size_t kheap_used(void);
@@ -202,6 +497,18 @@ void *kheap_alloc(size_t size);
 void kheap_free(void *ptr);
 void kheap_init(void);
 
+/* kernel/klog.c */
+void klog_write(int level, const char *text, size_t len);
+size_t klog_read(uint64_t *seq, char *buf, size_t nbyte);
+void klog_sync(void);
+int klog_enabled(int sys, int level);
+int klog_set_level(int sys, int level);
+ssize_t klog_configure(const char *buf, size_t nbyte);
+void klog_init(void);
+
+/* kernel/lz4.c */
+ssize_t lz4_decompress(const void *src, size_t srclen, void *dst, size_t dstlen);
+
 /* kernel/mboot.c */
 void mboot_init(uintptr_t paddr);
 void mboot_dump(void);
@@ -211,6 +518,15 @@ uintptr_t mboot_vbe_mode_info_ptr(void);
 size_t mboot_mmap_entry_count(void);
 void mboot_mmap_entry_read(size_t n, uintptr_t *addr, size_t *len, int *avail);
 
+/* kernel/pci.c */
+uint32_t pci_read(struct pci_dev *pdev, uint8_t off);
+void pci_write(struct pci_dev *pdev, uint8_t off, uint32_t val);
+int pci_find(uint16_t vendor, uint16_t device, struct pci_dev *dest);
+void pci_enable(struct pci_dev *pdev);
+
+/* kernel/pipefs.c */
+int pipefs_mount(const char *path);
+
 /* kernel/pit.c */
 void pit_init(void);
 uint64_t pit_get_msecs(void);
@@ -222,15 +538,17 @@ void pmem_free(uintptr_t paddr);
 void pmem_dump_avail(void);
 void pmem_dump_kern(void);
 size_t pmem_total(void);
+size_t pmem_avail(void);
 
 /* kernel/printk.c */
-int printk(int level, const char *fmt, ...);
+int kprintf(int level, const char *fmt, ...);
 int vprintk(int level, const char *fmt, va_list args);
 
 /* kernel/ptt.c */
 void ptt_init(void);
 void ptt_map(uintptr_t vaddr, uintptr_t paddr, uint8_t user, uint8_t present);
 void ptt_unmap(uintptr_t vaddr);
+uintptr_t ptt_paddr(uintptr_t vaddr);
 
 /* kernel/romfs.c */
 int romfs_mount(uintptr_t addr, const char *path);
@@ -242,12 +560,26 @@ task_pid_t task_spawn_name(char *name, int argc, char **argv);
 int task_waitpid(task_pid_t pid);
 int task_switch(void);
 void task_sleep(uint64_t msecs);
+void task_wait(const void *chan);
+void task_wait_timeout(const void *chan, uint64_t msecs);
+void task_wakeup(const void *chan);
 void task_exit(uint8_t code);
 int task_count(void);
+struct fdtable *task_fdtable(void);
+void task_borrow_fdtable(struct fdtable *fdt);
+int task_vt(void);
+void task_set_vt(int con);
+
+/* kernel/tmpfs.c */
+int tmpfs_mount(const char *path);
 
 /* kernel/uart.c */
 void uart_init(void);
+void uart_intr_init(void);
 void uart_write(const char *msg, size_t nbytes);
+size_t uart_read(void *buf, size_t nbyte);
+size_t uart_pending(void);
+void uart_sync(void);
 
 /* kernel/vbe.c */
 int vbe_gfx_mode(void);
@@ -259,11 +591,20 @@ void vbe_init(void);
 void vfs_init(void);
 int vfs_mount(const char *path, struct vfs_ops *ops, uintptr_t sbh);
 int vfs_open(const char *path);
+int vfs_open_flags(const char *path, int flags);
+
+/* kernel/virtio.c */
+void virtio_blk_init(void);
 
 /* kernel/vt.c */
-typedef void (*vt_flush_cb)(uint16_t *buf, int cols, int rows);
-size_t vt_write(const char *buf, size_t n);
+typedef void (*vt_flush_cb)(int cols, int rows, int scroll, struct vt_damage *dmg, int count);
+size_t vt_write(int con, const char *buf, size_t n);
+void vt_scrollback(int lines);
+void vt_switch(int con);
+int vt_active(void);
+void vt_sync(void);
 void vt_set_flush_cb(vt_flush_cb cb);
+void vt_flush_init(void);
 void vt_init(void);
 
 #endif // _KERNEL_KERNEL_H_
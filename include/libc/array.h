@@ -67,4 +67,92 @@
         __ret;                                              \
     }))
 
+/*
+ * pools are arrays whose free slots are threaded into a list through the
+ * next_free member of the elements, so taking and releasing a slot is O(1).
+ * the head of the list is declared next to the array with ARRAY_POOL_HEAD.
+ */
+#define ARRAY_POOL_HEAD(a) array_index_t a##_free
+
+#define ARRAY_POOL_INIT(a)                                  \
+    (__extension__({                                        \
+        ARRAY_FOREACH(a, __i) {                             \
+            a[__i].active = 0;                              \
+            a[__i].next_free = __i + 1;                     \
+        }                                                   \
+        a[ARRAY_LENGTH(a) - 1].next_free = ARRAY_INDEX_NONE;\
+        a##_free = 0;                                       \
+    }))
+
+#define ARRAY_POOL_TAKE(a)                                  \
+    (__extension__({                                        \
+        __typeof__(a[0]) *__ret = NULL;                     \
+        if (a##_free != ARRAY_INDEX_NONE) {                 \
+            __ret = &a[a##_free];                           \
+            a##_free = __ret->next_free;                    \
+            __ret->active = 1;                              \
+        }                                                   \
+        __ret;                                              \
+    }))
+
+#define ARRAY_POOL_RELEASE(a, x)                            \
+    (__extension__({                                        \
+        __typeof__(a[0]) *__x = (x);                        \
+        if (__x->active) {                                  \
+            __x->active = 0;                                \
+            __x->next_free = a##_free;                      \
+            a##_free = __x - a;                             \
+        }                                                   \
+    }))
+
+/*
+ * hashes index active elements by a string member. elements with the same
+ * hash bucket are chained through their next_hash member, the bucket heads
+ * are declared with ARRAY_HASH_HEAD (n must be a power of two).
+ */
+#define ARRAY_HASH_HEAD(a, n) array_index_t a##_hash[n]
+
+#define ARRAY_HASH_BUCKET(a, v) (strhash(v) & (ARRAY_LENGTH(a##_hash) - 1))
+
+#define ARRAY_HASH_INIT(a)                                  \
+    (__extension__({                                        \
+        ARRAY_FOREACH(a##_hash, __i) {                      \
+            a##_hash[__i] = ARRAY_INDEX_NONE;               \
+        }                                                   \
+    }))
+
+#define ARRAY_HASH_INSERT(a, x, f)                          \
+    (__extension__({                                        \
+        __typeof__(a[0]) *__x = (x);                        \
+        size_t __b = ARRAY_HASH_BUCKET(a, __x->f);          \
+        __x->next_hash = a##_hash[__b];                     \
+        a##_hash[__b] = __x - a;                            \
+    }))
+
+#define ARRAY_HASH_REMOVE(a, x, f)                          \
+    (__extension__({                                        \
+        __typeof__(a[0]) *__x = (x);                        \
+        array_index_t *__p = &a##_hash[ARRAY_HASH_BUCKET(a, __x->f)]; \
+        while (*__p != ARRAY_INDEX_NONE && &a[*__p] != __x) {\
+            __p = &a[*__p].next_hash;                       \
+        }                                                   \
+        if (*__p != ARRAY_INDEX_NONE) {                     \
+            *__p = __x->next_hash;                          \
+        }                                                   \
+    }))
+
+#define ARRAY_HASH_FIND_BY(a, f, v, i)                      \
+    (__extension__({                                        \
+        __typeof__(a[0]) *__ret = NULL;                     \
+        *i = a##_hash[ARRAY_HASH_BUCKET(a, v)];             \
+        while (*i != ARRAY_INDEX_NONE) {                    \
+            if (!strcmp(a[*i].f, v)) {                      \
+                __ret = &a[*i];                             \
+                break;                                      \
+            }                                               \
+            *i = a[*i].next_hash;                           \
+        }                                                   \
+        __ret;                                              \
+    }))
+
 #endif // _LIBC_ARRAY_H_
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/aio.c - asynchronous i/o through submission and completion rings
+ *
+ * a task prepares requests in the submission queue of a ring and
+ * publishes a whole batch with one call. a worker task of the ring
+ * executes them with the descriptors of the owner and posts results to
+ * the completion queue, which the owner polls or blocks on. each queue
+ * has a single producer and a single consumer updating only their own
+ * index, like pipes. requests of a ring are executed in order, a request
+ * which blocks delays only the ones behind it in the same ring. a ring
+ * destroyed during a request is detached from its owner and released by
+ * the worker once the request returns.
+ */
+
+#define KLOG_SUBSYS KLOG_SYS_FS
+
+#include <kernel/kernel.h>
+
+enum {
+    AIO_RING_COUNT  = 4,            // max number of rings
+    AIO_RING_SIZE   = 64,           // entries of each queue, power of two
+};
+
+/* submission and completion queues of a task */
+struct aio_ring {
+    uint8_t active;
+    array_index_t next_free;
+
+    struct fdtable *fdt;            // descriptors of the owner
+    uint8_t busy;                   // a request is being executed
+    uint8_t worker;                 // the worker of the slot is started
+    uint8_t dead;                   // destroyed while a request was executed
+
+    size_t sq_head;                 // consumed by the worker
+    size_t sq_tail;                 // published by the owner
+    size_t sq_prepared;             // taken by the owner, not published yet
+    size_t cq_head;                 // consumed by the owner
+    size_t cq_tail;                 // published by the worker
+
+    struct aio_sqe *sq;
+    struct aio_cqe *cq;
+};
+
+/* private functions */
+static struct aio_ring *aio_get(int ring);
+static int aio_pending(struct aio_ring *ring);
+static ssize_t aio_do(struct aio_sqe *sqe);
+static void aio_execute(struct aio_ring *ring);
+static void aio_worker(int argc, char **argv);
+
+/* array of rings */
+static struct aio_ring aio_rings[AIO_RING_COUNT];
+static ARRAY_POOL_HEAD(aio_rings);
+
+/* return a ring of the current task or NULL */
+static struct aio_ring *
+aio_get(int ring)
+{
+    if (!ARRAY_CHECK_INDEX(aio_rings, ring) || aio_rings[ring].fdt != task_fdtable()) {
+        return NULL;
+    }
+
+    return &aio_rings[ring];
+}
+
+/* check if a ring has a request to execute and room for its result */
+static int
+aio_pending(struct aio_ring *ring)
+{
+    return ring->active &&
+           ring->sq_head != __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE) &&
+           ring->cq_tail - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE) < AIO_RING_SIZE;
+}
+
+/* execute a request with the descriptors of its owner */
+static ssize_t
+aio_do(struct aio_sqe *sqe)
+{
+    switch (sqe->op) {
+    case AIO_OP_NOP:
+        return 0;
+    case AIO_OP_READ:
+        if (sqe->off >= 0) {
+            return file_pread(sqe->fd, sqe->buf, sqe->nbyte, sqe->off);
+        }
+        return file_read(sqe->fd, sqe->buf, sqe->nbyte);
+    case AIO_OP_WRITE:
+        if (sqe->off >= 0) {
+            return file_pwrite(sqe->fd, sqe->buf, sqe->nbyte, sqe->off);
+        }
+        return file_write(sqe->fd, sqe->buf, sqe->nbyte);
+    case AIO_OP_OPEN:
+        return vfs_open_flags(sqe->path, sqe->flags);
+    case AIO_OP_CLOSE:
+        return file_close(sqe->fd);
+    default:
+        return -1;
+    }
+}
+
+/* consume one request of a ring and post its result */
+static void
+aio_execute(struct aio_ring *ring)
+{
+    struct aio_sqe sqe;
+    struct aio_cqe *cqe;
+    ssize_t res;
+
+    // copy the request, so its slot can be reused while it's executed
+    memcpy(&sqe, &ring->sq[ring->sq_head & (AIO_RING_SIZE - 1)], sizeof(sqe));
+    __atomic_store_n(&ring->sq_head, ring->sq_head + 1, __ATOMIC_RELEASE);
+
+    ring->busy = 1;
+    task_borrow_fdtable(ring->fdt);
+    res = aio_do(&sqe);
+
+    // a file opened for a destroyed ring has no owner to close it
+    if (ring->dead && sqe.op == AIO_OP_OPEN && res >= 0) {
+        (void)file_close(res);
+    }
+
+    task_borrow_fdtable(NULL);
+    ring->busy = 0;
+
+    // nobody waits for the result of a destroyed ring
+    if (ring->dead) {
+        ring->dead = 0;
+        ARRAY_POOL_RELEASE(aio_rings, ring);
+        return;
+    }
+
+    cqe = &ring->cq[ring->cq_tail & (AIO_RING_SIZE - 1)];
+    cqe->user = sqe.user;
+    cqe->res = res;
+    __atomic_store_n(&ring->cq_tail, ring->cq_tail + 1, __ATOMIC_RELEASE);
+
+    task_wakeup(ring);
+}
+
+/* execute requests of the ring given as argc, sleep while there are none */
+static void
+aio_worker(int argc, char **argv)
+{
+    struct aio_ring *ring = &aio_rings[argc];
+    uint64_t flags;
+
+    // don't keep files of the spawning task open
+    fdtable_close_all(task_fdtable());
+
+    while (1) {
+        flags = cpu_get_flags();
+        cpu_cli();
+
+        while (!aio_pending(ring)) {
+            task_wait(&ring->sq_tail);
+        }
+
+        cpu_set_flags(flags);
+
+        aio_execute(ring);
+    }
+}
+
+/* create a ring for the current task. return its number or -1 */
+int
+aio_setup(void)
+{
+    struct aio_ring *ring = ARRAY_POOL_TAKE(aio_rings);
+
+    if (!ring) {
+        printk(KERN_WARN, "too many aio rings\n");
+        return -1;
+    }
+
+    // the queues stay with the slot, kernel heap can't free memory
+    if (!ring->sq) {
+        ring->sq = kheap_alloc(AIO_RING_SIZE * sizeof(struct aio_sqe));
+        ring->cq = kheap_alloc(AIO_RING_SIZE * sizeof(struct aio_cqe));
+    }
+
+    if (!ring->sq || !ring->cq) {
+        ARRAY_POOL_RELEASE(aio_rings, ring);
+        return -1;
+    }
+
+    ring->fdt = task_fdtable();
+    ring->busy = 0;
+    ring->dead = 0;
+    ring->sq_head = 0;
+    ring->sq_tail = 0;
+    ring->sq_prepared = 0;
+    ring->cq_head = 0;
+    ring->cq_tail = 0;
+
+    // workers stay with their slots too and never exit
+    if (!ring->worker) {
+        if (task_spawn((uintptr_t)aio_worker, ring - aio_rings, NULL) < 0) {
+            printk(KERN_WARN, "cannot start an aio worker\n");
+            ARRAY_POOL_RELEASE(aio_rings, ring);
+            return -1;
+        }
+        ring->worker = 1;
+    }
+
+    return ring - aio_rings;
+}
+
+/* return the next free submission queue entry, or NULL if the queue is full */
+struct aio_sqe *
+aio_get_sqe(int ring)
+{
+    struct aio_ring *r = aio_get(ring);
+    struct aio_sqe *sqe;
+
+    if (!r || r->sq_prepared - __atomic_load_n(&r->sq_head, __ATOMIC_ACQUIRE) == AIO_RING_SIZE) {
+        return NULL;
+    }
+
+    sqe = &r->sq[r->sq_prepared++ & (AIO_RING_SIZE - 1)];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->off = -1;
+
+    return sqe;
+}
+
+/* pass all prepared entries to the worker. return their amount or -1 */
+int
+aio_submit(int ring)
+{
+    struct aio_ring *r = aio_get(ring);
+    size_t count;
+
+    if (!r) {
+        return -1;
+    }
+
+    count = r->sq_prepared - r->sq_tail;
+
+    if (count) {
+        __atomic_store_n(&r->sq_tail, r->sq_prepared, __ATOMIC_RELEASE);
+        task_wakeup(&r->sq_tail);
+    }
+
+    return count;
+}
+
+/* take a completion without blocking. return 0 on success, -1 if none */
+int
+aio_peek(int ring, struct aio_cqe *cqe)
+{
+    struct aio_ring *r = aio_get(ring);
+
+    if (!r || r->cq_head == __atomic_load_n(&r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    memcpy(cqe, &r->cq[r->cq_head & (AIO_RING_SIZE - 1)], sizeof(*cqe));
+    __atomic_store_n(&r->cq_head, r->cq_head + 1, __ATOMIC_RELEASE);
+
+    // the worker may be waiting for room in the queue
+    task_wakeup(&r->sq_tail);
+
+    return 0;
+}
+
+/*
+ * take a completion, block until one is posted. return 0 on success or
+ * -1 if there are no submitted requests left to complete
+ */
+int
+aio_wait(int ring, struct aio_cqe *cqe)
+{
+    struct aio_ring *r = aio_get(ring);
+    uint64_t flags;
+    int ret;
+
+    if (!r) {
+        return -1;
+    }
+
+    flags = cpu_get_flags();
+    cpu_cli();
+
+    while ((ret = aio_peek(ring, cqe)) && r->cq_head != r->sq_tail) {
+        task_wait(r);
+    }
+
+    cpu_set_flags(flags);
+
+    return ret;
+}
+
+/*
+ * destroy a ring, requests which didn't start yet are dropped. a request
+ * being executed may block for good, so the ring is detached from the
+ * owner instead of waiting for it and the worker releases it later
+ */
+void
+aio_destroy(int ring)
+{
+    struct aio_ring *r = aio_get(ring);
+    uint64_t flags;
+
+    if (!r) {
+        return;
+    }
+
+    flags = cpu_get_flags();
+    cpu_cli();
+
+    if (r->busy) {
+        r->fdt = NULL;
+        r->dead = 1;
+    } else {
+        ARRAY_POOL_RELEASE(aio_rings, r);
+    }
+
+    cpu_set_flags(flags);
+}
+
+/* destroy all rings of the current task */
+void
+aio_task_exit(void)
+{
+    ARRAY_FOREACH(aio_rings, i) {
+        if (aio_get(i)) {
+            aio_destroy(i);
+        }
+    }
+}
+
+/* initialize rings, workers are started by the first setup of each slot */
+void
+aio_init(void)
+{
+    ARRAY_POOL_INIT(aio_rings);
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/ata.c - ATA disk driver (primary master, PIO mode, polling)
+ */
+
+#include <kernel/kernel.h>
+
+/* i/o ports */
+enum {
+    ATA_PORT_DATA       = 0x1F0,
+    ATA_PORT_ERROR      = 0x1F1,
+    ATA_PORT_COUNT      = 0x1F2,
+    ATA_PORT_LBA0       = 0x1F3,
+    ATA_PORT_LBA1       = 0x1F4,
+    ATA_PORT_LBA2       = 0x1F5,
+    ATA_PORT_DRIVE      = 0x1F6,
+    ATA_PORT_CMD        = 0x1F7,
+    ATA_PORT_STATUS     = 0x1F7,
+    ATA_PORT_CTRL       = 0x3F6,
+};
+
+/* status bits */
+enum {
+    ATA_SR_ERR          = 0x01,
+    ATA_SR_DRQ          = 0x08,
+    ATA_SR_DF           = 0x20,
+    ATA_SR_BSY          = 0x80,
+};
+
+/* commands and misc values */
+enum {
+    ATA_CMD_READ        = 0x20,
+    ATA_CMD_WRITE       = 0x30,
+    ATA_CMD_FLUSH       = 0xE7,
+    ATA_CMD_IDENTIFY    = 0xEC,
+    ATA_DRIVE_LBA       = 0xE0,     // master drive, lba addressing
+    ATA_CTRL_NIEN       = 0x02,     // no interrupts
+    ATA_LBA28_MAX       = 0x10000000,
+    ATA_TIMEOUT         = 0x100000,
+};
+
+/* private functions */
+static uint8_t ata_status(void);
+static int ata_poll(uint8_t mask, uint8_t want);
+static void ata_select(uint64_t lba, uint8_t count);
+static int ata_transfer(struct blk_req *req);
+static int ata_submit(uintptr_t drvh, struct blk_req *req);
+
+/* block device operations */
+static struct blk_ops ata_ops = {
+    .submit_fn = &ata_submit,
+};
+
+/* read the status register after the mandatory 400ns delay */
+static uint8_t
+ata_status(void)
+{
+    for (int i = 0; i < 4; ++i) {
+        (void)cpu_inb(ATA_PORT_CTRL);
+    }
+
+    return cpu_inb(ATA_PORT_STATUS);
+}
+
+/* wait for status bits in mask to match want. return 0 on success */
+static int
+ata_poll(uint8_t mask, uint8_t want)
+{
+    uint8_t status;
+
+    for (int i = 0; i < ATA_TIMEOUT; ++i) {
+        status = ata_status();
+
+        if (!(status & ATA_SR_BSY) && (status & (ATA_SR_ERR | ATA_SR_DF))) {
+            return -1;
+        }
+
+        if ((status & mask) == want) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* select the drive and a range of sectors */
+static void
+ata_select(uint64_t lba, uint8_t count)
+{
+    cpu_outb(ATA_PORT_DRIVE, ATA_DRIVE_LBA | ((lba >> 24) & 0x0F));
+    cpu_outb(ATA_PORT_COUNT, count);
+    cpu_outb(ATA_PORT_LBA0, lba & 0xFF);
+    cpu_outb(ATA_PORT_LBA1, (lba >> 8) & 0xFF);
+    cpu_outb(ATA_PORT_LBA2, (lba >> 16) & 0xFF);
+}
+
+/* transfer sectors of a request, up to 256 per command. return 0 on success */
+static int
+ata_transfer(struct blk_req *req)
+{
+    uint8_t *buf = req->buf;
+    uint64_t lba = req->sector;
+    size_t left = req->count;
+    size_t n;
+
+    while (left) {
+        n = (left < 256) ? left : 256;
+
+        if (ata_poll(ATA_SR_BSY, 0)) {
+            return -1;
+        }
+
+        ata_select(lba, n & 0xFF);
+        cpu_outb(ATA_PORT_CMD, req->write ? ATA_CMD_WRITE : ATA_CMD_READ);
+
+        for (size_t i = 0; i < n; ++i, buf += BLK_SECTOR_SIZE) {
+            if (ata_poll(ATA_SR_BSY | ATA_SR_DRQ, ATA_SR_DRQ)) {
+                return -1;
+            }
+
+            if (req->write) {
+                cpu_outsw(ATA_PORT_DATA, buf, BLK_SECTOR_SIZE / 2);
+            } else {
+                cpu_insw(ATA_PORT_DATA, buf, BLK_SECTOR_SIZE / 2);
+            }
+        }
+
+        lba += n;
+        left -= n;
+    }
+
+    if (req->write) {
+        cpu_outb(ATA_PORT_CMD, ATA_CMD_FLUSH);
+        return ata_poll(ATA_SR_BSY, 0);
+    }
+
+    return 0;
+}
+
+/* execute a request, it's completed before returning */
+static int
+ata_submit(uintptr_t drvh, struct blk_req *req)
+{
+    if (req->sector + req->count > ATA_LBA28_MAX) {
+        return -1;
+    }
+
+    blk_complete(req, ata_transfer(req));
+
+    return 0;
+}
+
+/* detect the primary master disk and register it as a block device */
+void
+ata_init(void)
+{
+    uint16_t id[256];
+    uint64_t sectors;
+
+    cpu_outb(ATA_PORT_CTRL, ATA_CTRL_NIEN);
+
+    ata_select(0, 0);
+    cpu_outb(ATA_PORT_CMD, ATA_CMD_IDENTIFY);
+
+    // no drive, or not an ata one
+    if (ata_status() == 0 || ata_poll(ATA_SR_BSY, 0)) {
+        return;
+    }
+
+    if (cpu_inb(ATA_PORT_LBA1) || cpu_inb(ATA_PORT_LBA2)) {
+        return;
+    }
+
+    if (ata_poll(ATA_SR_DRQ, ATA_SR_DRQ)) {
+        return;
+    }
+
+    cpu_insw(ATA_PORT_DATA, id, 256);
+
+    // number of lba28 addressable sectors
+    sectors = id[60] | ((uint32_t)id[61] << 16);
+
+    if (sectors) {
+        (void)blk_register("hda", &ata_ops, 0, sectors);
+    }
+}
@@ -0,0 +1,744 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/blkdev.c - block devices and the buffer cache
+ *
+ * all devices share a cache of BLK_SIZE buffers, found through a hash
+ * table keyed by device and block number. buffers which are neither in
+ * use nor under i/o are kept in an lru list, the least recently used one
+ * is reused on a miss, after writing it back if it's dirty. sequential
+ * reads start an asynchronous readahead window which doubles up to
+ * BLK_RA_MAX blocks. each device follows a few streams keyed by the block
+ * they expect next, so metadata reads in between don't close the window
+ * of a file being read. drivers may queue requests until they're kicked,
+ * which happens once a batch is submitted or before waiting for i/o, and
+ * complete them from interrupt handlers, so the cache is only modified
+ * with interrupts disabled.
+ */
+
+#define KLOG_SUBSYS KLOG_SYS_BLK
+
+#include <kernel/kernel.h>
+
+enum {
+    BLKDEV_COUNT        = 4,                            // max number of devices
+    BLK_BUF_COUNT       = 64,                           // buffers in the cache
+    BLK_RA_MAX          = 16,                           // max readahead blocks
+    BLK_RA_STREAMS      = 4,                            // readers followed per device
+    BLK_SECTORS         = BLK_SIZE / BLK_SECTOR_SIZE,   // sectors per block
+};
+
+/* readahead state of a reader */
+struct blk_stream {
+    uint64_t next;                  // block expected by a sequential reader
+    uint64_t end;                   // first block not read ahead yet
+    size_t window;
+    uint64_t used;                  // for replacing the least recently used
+};
+
+/* block device */
+struct blkdev {
+    uint8_t active;
+    array_index_t next_free;
+    array_index_t next_hash;
+    char name[NAME_MAX];
+
+    struct blk_ops *ops;
+    uintptr_t drvh;
+    uint64_t sectors;
+
+    struct blk_stream streams[BLK_RA_STREAMS];
+    uint64_t ra_tick;
+
+    struct blk_stats stats;
+};
+
+/* private functions */
+static uint64_t blk_irq_save(void);
+static size_t blk_bucket(int dev, uint64_t blkno);
+static void blk_lru_remove(struct blk_buf *buf);
+static void blk_lru_append(struct blk_buf *buf);
+static struct blk_buf *blk_lookup(int dev, uint64_t blkno);
+static void blk_buf_done(struct blk_req *req);
+static void blk_kick(void);
+static void blk_wait(struct blk_buf *buf);
+static int blk_submit(struct blk_buf *buf, int write);
+static struct blk_buf *blk_evict(void);
+static void blk_hash_insert(struct blk_buf *buf, int dev, uint64_t blkno);
+static struct blk_buf *blk_getblk(int dev, uint64_t blkno, int fill);
+static void blk_readahead(struct blkdev *dev, uint64_t first, uint64_t last);
+static struct blk_buf *blk_finish(struct blk_buf *buf, int fill);
+
+/* array of devices */
+static struct blkdev blkdevs[BLKDEV_COUNT];
+static ARRAY_POOL_HEAD(blkdevs);
+static ARRAY_HASH_HEAD(blkdevs, BLKDEV_COUNT);
+
+/* buffer cache */
+static struct blk_buf blk_bufs[BLK_BUF_COUNT];
+static array_index_t blk_buckets[BLK_BUF_COUNT];
+static array_index_t blk_lru_head;
+static array_index_t blk_lru_tail;
+
+/* disable interrupts and return previous flags */
+static uint64_t
+blk_irq_save(void)
+{
+    uint64_t flags = cpu_get_flags();
+
+    cpu_cli();
+
+    return flags;
+}
+
+/* return a hash bucket of a given block */
+static size_t
+blk_bucket(int dev, uint64_t blkno)
+{
+    return (blkno * 0x9E3779B1 + dev) & (BLK_BUF_COUNT - 1);
+}
+
+/* remove a buffer from the lru list */
+static void
+blk_lru_remove(struct blk_buf *buf)
+{
+    if (buf->lru_prev != ARRAY_INDEX_NONE) {
+        blk_bufs[buf->lru_prev].lru_next = buf->lru_next;
+    } else {
+        blk_lru_head = buf->lru_next;
+    }
+
+    if (buf->lru_next != ARRAY_INDEX_NONE) {
+        blk_bufs[buf->lru_next].lru_prev = buf->lru_prev;
+    } else {
+        blk_lru_tail = buf->lru_prev;
+    }
+
+    buf->lru_prev = ARRAY_INDEX_NONE;
+    buf->lru_next = ARRAY_INDEX_NONE;
+}
+
+/* append a buffer to the lru list as the most recently used */
+static void
+blk_lru_append(struct blk_buf *buf)
+{
+    array_index_t idx = buf - blk_bufs;
+
+    buf->lru_prev = blk_lru_tail;
+    buf->lru_next = ARRAY_INDEX_NONE;
+
+    if (blk_lru_tail != ARRAY_INDEX_NONE) {
+        blk_bufs[blk_lru_tail].lru_next = idx;
+    } else {
+        blk_lru_head = idx;
+    }
+
+    blk_lru_tail = idx;
+
+    task_wakeup(&blk_lru_head);
+}
+
+/* find a cached block */
+static struct blk_buf *
+blk_lookup(int dev, uint64_t blkno)
+{
+    array_index_t i = blk_buckets[blk_bucket(dev, blkno)];
+
+    for (; i != ARRAY_INDEX_NONE; i = blk_bufs[i].next_hash) {
+        if (blk_bufs[i].dev == dev && blk_bufs[i].blkno == blkno) {
+            return &blk_bufs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* finish i/o on a buffer, called by drivers through blk_complete() */
+static void
+blk_buf_done(struct blk_req *req)
+{
+    struct blk_buf *buf = req->priv;
+    struct blk_stats *stats = &blkdevs[buf->dev].stats;
+    uint64_t msecs = pit_get_msecs() - buf->started;
+
+    if (req->write) {
+        stats->write_bytes += req->count * BLK_SECTOR_SIZE;
+        stats->write_msecs += msecs;
+
+        if (req->status) {
+            printk(KERN_WARN, "blk: lost block %lu\n", buf->blkno);
+        }
+        buf->dirty = 0;
+    } else {
+        stats->read_bytes += req->count * BLK_SECTOR_SIZE;
+        stats->read_msecs += msecs;
+        buf->valid = !req->status;
+    }
+
+    buf->busy = 0;
+
+    if (!buf->refs) {
+        blk_lru_append(buf);
+    }
+
+    task_wakeup(buf);
+}
+
+/* let drivers start requests they have queued, interrupts must be disabled */
+static void
+blk_kick(void)
+{
+    ARRAY_FOREACH(blkdevs, i) {
+        if (blkdevs[i].active && blkdevs[i].ops->kick_fn) {
+            blkdevs[i].ops->kick_fn(blkdevs[i].drvh);
+        }
+    }
+}
+
+/* wait until i/o on a buffer is finished, interrupts must be disabled */
+static void
+blk_wait(struct blk_buf *buf)
+{
+    if (buf->busy) {
+        blk_kick();
+    }
+
+    while (buf->busy) {
+        task_wait(buf);
+    }
+}
+
+/* start reading or writing a buffer */
+static int
+blk_submit(struct blk_buf *buf, int write)
+{
+    struct blkdev *dev = &blkdevs[buf->dev];
+    struct blk_req *req = &buf->req;
+    uint64_t sector = buf->blkno * BLK_SECTORS;
+
+    req->dev = buf->dev;
+    req->write = write;
+    req->sector = sector;
+    req->count = (dev->sectors - sector < BLK_SECTORS) ? dev->sectors - sector : BLK_SECTORS;
+    req->buf = buf->data;
+    req->status = 0;
+    req->done_fn = &blk_buf_done;
+    req->priv = buf;
+    req->next = NULL;
+
+    buf->busy = 1;
+    buf->started = pit_get_msecs();
+
+    if (dev->ops->submit_fn(dev->drvh, req)) {
+        buf->busy = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* take the least recently used clean buffer out of the cache, or NULL */
+static struct blk_buf *
+blk_evict(void)
+{
+    struct blk_buf *buf;
+    array_index_t *p;
+
+    while (1) {
+        if (blk_lru_head == ARRAY_INDEX_NONE) {
+            return NULL;
+        }
+
+        buf = &blk_bufs[blk_lru_head];
+        blk_lru_remove(buf);
+
+        if (!buf->dirty) {
+            break;
+        }
+
+        // write back and keep looking, the buffer returns to the list when done
+        if (blk_submit(buf, 1)) {
+            printk(KERN_WARN, "blk: lost block %lu\n", buf->blkno);
+            buf->dirty = 0;
+            break;
+        }
+    }
+
+    if (buf->dev >= 0) {
+        p = &blk_buckets[blk_bucket(buf->dev, buf->blkno)];
+        while (&blk_bufs[*p] != buf) {
+            p = &blk_bufs[*p].next_hash;
+        }
+        *p = buf->next_hash;
+    }
+
+    buf->dev = -1;
+    buf->valid = 0;
+
+    return buf;
+}
+
+/* assign a buffer to a given block */
+static void
+blk_hash_insert(struct blk_buf *buf, int dev, uint64_t blkno)
+{
+    size_t bucket = blk_bucket(dev, blkno);
+
+    buf->dev = dev;
+    buf->blkno = blkno;
+    buf->next_hash = blk_buckets[bucket];
+    blk_buckets[bucket] = buf - blk_bufs;
+}
+
+/*
+ * take a reference to the buffer of a given block and optionally start
+ * reading it, without waiting for the data. interrupts must be disabled
+ */
+static struct blk_buf *
+blk_getblk(int dev, uint64_t blkno, int fill)
+{
+    struct blk_stats *stats = &blkdevs[dev].stats;
+    struct blk_buf *buf;
+
+    while (1) {
+        if ((buf = blk_lookup(dev, blkno))) {
+            if (!buf->refs && !buf->busy) {
+                blk_lru_remove(buf);
+            }
+            stats->hits++;
+            break;
+        }
+
+        if ((buf = blk_evict())) {
+            blk_hash_insert(buf, dev, blkno);
+            stats->misses++;
+            break;
+        }
+
+        // every buffer is in use or being written back
+        blk_kick();
+        task_wait(&blk_lru_head);
+    }
+
+    buf->refs++;
+
+    if (fill && !buf->valid && !buf->busy) {
+        (void)blk_submit(buf, 0);
+    }
+
+    return buf;
+}
+
+/*
+ * start reading the blocks of a request after the first one and, for
+ * sequential readers, a window of blocks beyond the request. the window
+ * of a stream doubles as long as its requests follow each other, other
+ * requests replace the least recently used stream. interrupts must be
+ * disabled
+ */
+static void
+blk_readahead(struct blkdev *dev, uint64_t first, uint64_t last)
+{
+    uint64_t nblocks = (dev->sectors + BLK_SECTORS - 1) / BLK_SECTORS;
+    struct blk_stream *s = &dev->streams[0];
+    struct blk_buf *buf;
+
+    for (size_t i = 0; i < BLK_RA_STREAMS; ++i) {
+        if (first == dev->streams[i].next || first + 1 == dev->streams[i].next) {
+            s = &dev->streams[i];
+            break;
+        }
+
+        if (dev->streams[i].used < s->used) {
+            s = &dev->streams[i];
+        }
+    }
+
+    if (first == s->next) {
+        s->window = s->window ? s->window * 2 : 2;
+        if (s->window > BLK_RA_MAX) {
+            s->window = BLK_RA_MAX;
+        }
+    } else if (first + 1 != s->next) {
+        // a new stream starts without a window
+        s->window = 0;
+        s->end = first + 1;
+    }
+
+    s->next = last + 1;
+    s->used = ++dev->ra_tick;
+
+    if (s->end <= first) {
+        s->end = first + 1;
+    }
+
+    for (; s->end <= last + s->window && s->end < nblocks; ++s->end) {
+        if (blk_lookup(dev - blkdevs, s->end)) {
+            continue;
+        }
+
+        if (!(buf = blk_evict())) {
+            break;
+        }
+
+        blk_hash_insert(buf, dev - blkdevs, s->end);
+
+        if (s->end > last) {
+            dev->stats.readahead++;
+        }
+
+        if (blk_submit(buf, 0)) {
+            blk_lru_append(buf);
+            break;
+        }
+    }
+
+    // the whole range goes to the driver as one batch
+    blk_kick();
+}
+
+/*
+ * wait for i/o on a buffer returned by blk_getblk(). return the buffer,
+ * or NULL if it had to be filled and reading failed
+ */
+static struct blk_buf *
+blk_finish(struct blk_buf *buf, int fill)
+{
+    blk_wait(buf);
+
+    if (fill && !buf->valid) {
+        blk_put(buf);
+        return NULL;
+    }
+
+    buf->valid = 1;
+
+    return buf;
+}
+
+/* register a block device. return its number or -1 */
+int
+blk_register(const char *name, struct blk_ops *ops, uintptr_t drvh,
+             uint64_t sectors)
+{
+    struct blkdev *dev = ARRAY_POOL_TAKE(blkdevs);
+
+    if (!dev) {
+        printk(KERN_WARN, "cannot register %s, too many block devices\n", name);
+        return -1;
+    }
+
+    strncpy(dev->name, name, NAME_MAX - 1);
+    dev->name[NAME_MAX - 1] = 0;
+    dev->ops = ops;
+    dev->drvh = drvh;
+    dev->sectors = sectors;
+    memset(dev->streams, 0, sizeof(dev->streams));
+    dev->ra_tick = 0;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    ARRAY_HASH_INSERT(blkdevs, dev, name);
+
+    printk(KERN_INFO, "blk: %s, %lu KiB\n", dev->name, sectors * BLK_SECTOR_SIZE / 1024);
+
+    return dev - blkdevs;
+}
+
+/* find a block device by name. return its number or -1 */
+int
+blk_find(const char *name)
+{
+    array_index_t i;
+
+    if (!ARRAY_HASH_FIND_BY(blkdevs, name, name, &i)) {
+        return -1;
+    }
+
+    return i;
+}
+
+/* return size of a block device in bytes */
+uint64_t
+blk_size(int dev)
+{
+    if (!ARRAY_CHECK_INDEX(blkdevs, dev)) {
+        return 0;
+    }
+
+    return blkdevs[dev].sectors * BLK_SECTOR_SIZE;
+}
+
+/* finish a request, called by drivers */
+void
+blk_complete(struct blk_req *req, int status)
+{
+    req->status = status;
+    req->done_fn(req);
+}
+
+/*
+ * return a referenced buffer holding a given block, or NULL on error.
+ * single block lookups are usually metadata, they don't read ahead
+ */
+struct blk_buf *
+blk_get(int dev, uint64_t blkno)
+{
+    struct blk_buf *buf;
+    uint64_t flags;
+
+    if (blkno >= (blk_size(dev) + BLK_SIZE - 1) / BLK_SIZE) {
+        return NULL;
+    }
+
+    flags = blk_irq_save();
+    buf = blk_getblk(dev, blkno, 1);
+    buf = blk_finish(buf, 1);
+    cpu_set_flags(flags);
+
+    return buf;
+}
+
+/* drop a reference to a buffer */
+void
+blk_put(struct blk_buf *buf)
+{
+    uint64_t flags = blk_irq_save();
+
+    if (!--buf->refs && !buf->busy) {
+        blk_lru_append(buf);
+    }
+
+    cpu_set_flags(flags);
+}
+
+/* mark a buffer as modified, it will be written back on eviction or sync */
+void
+blk_dirty(struct blk_buf *buf)
+{
+    buf->dirty = 1;
+}
+
+/* read data at a given offset of a device through the cache */
+ssize_t
+blk_read(int dev, void *buf, size_t nbyte, uint64_t off)
+{
+    uint64_t size = blk_size(dev);
+    uint64_t blkno, flags;
+    struct blk_buf *b;
+    size_t done = 0;
+    size_t ofs, len;
+
+    if (off >= size) {
+        return 0;
+    }
+
+    if (nbyte > size - off) {
+        nbyte = size - off;
+    }
+
+    while (done < nbyte) {
+        blkno = (off + done) / BLK_SIZE;
+
+        // the first block starts reading the whole request
+        flags = blk_irq_save();
+        b = blk_getblk(dev, blkno, 1);
+        if (!done) {
+            blk_readahead(&blkdevs[dev], blkno, (off + nbyte - 1) / BLK_SIZE);
+        }
+        b = blk_finish(b, 1);
+        cpu_set_flags(flags);
+
+        if (!b) {
+            return done ? (ssize_t)done : -1;
+        }
+
+        ofs = (off + done) % BLK_SIZE;
+        len = (BLK_SIZE - ofs < nbyte - done) ? BLK_SIZE - ofs : nbyte - done;
+
+        memcpy((uint8_t *)buf + done, b->data + ofs, len);
+        blk_put(b);
+
+        done += len;
+    }
+
+    return done;
+}
+
+/* write data at a given offset of a device through the cache */
+ssize_t
+blk_write(int dev, const void *buf, size_t nbyte, uint64_t off)
+{
+    uint64_t size = blk_size(dev);
+    struct blk_buf *b;
+    size_t done = 0;
+    size_t ofs, len;
+    uint64_t flags;
+
+    if (off >= size) {
+        return nbyte ? -1 : 0;
+    }
+
+    if (nbyte > size - off) {
+        nbyte = size - off;
+    }
+
+    while (done < nbyte) {
+        ofs = (off + done) % BLK_SIZE;
+        len = (BLK_SIZE - ofs < nbyte - done) ? BLK_SIZE - ofs : nbyte - done;
+
+        // whole blocks don't need to be read first
+        flags = blk_irq_save();
+        b = blk_getblk(dev, (off + done) / BLK_SIZE, len != BLK_SIZE);
+        b = blk_finish(b, len != BLK_SIZE);
+        cpu_set_flags(flags);
+
+        if (!b) {
+            return done ? (ssize_t)done : -1;
+        }
+
+        memcpy(b->data + ofs, (uint8_t *)buf + done, len);
+        blk_dirty(b);
+        blk_put(b);
+
+        done += len;
+    }
+
+    return done;
+}
+
+/*
+ * start reading blocks of a byte range into the cache without waiting.
+ * blocks which don't fit in the cache without waiting are skipped
+ */
+void
+blk_prefetch(int dev, uint64_t off, size_t nbyte)
+{
+    uint64_t size = blk_size(dev);
+    uint64_t blkno, last, flags;
+    struct blk_buf *buf;
+
+    if (!nbyte || off >= size) {
+        return;
+    }
+
+    if (nbyte > size - off) {
+        nbyte = size - off;
+    }
+
+    last = (off + nbyte - 1) / BLK_SIZE;
+
+    flags = blk_irq_save();
+
+    for (blkno = off / BLK_SIZE; blkno <= last; ++blkno) {
+        if (blk_lookup(dev, blkno)) {
+            continue;
+        }
+
+        if (!(buf = blk_evict())) {
+            break;
+        }
+
+        blk_hash_insert(buf, dev, blkno);
+        blkdevs[dev].stats.readahead++;
+
+        if (blk_submit(buf, 0)) {
+            blk_lru_append(buf);
+            break;
+        }
+    }
+
+    blk_kick();
+    cpu_set_flags(flags);
+}
+
+/* write back all dirty buffers of a device. return 0 on success */
+int
+blk_sync(int dev)
+{
+    struct blk_buf *buf;
+    uint64_t flags;
+    int ret = 0;
+
+    flags = blk_irq_save();
+
+    ARRAY_FOREACH(blk_bufs, i) {
+        buf = &blk_bufs[i];
+
+        if (buf->dev != dev || !buf->dirty || buf->busy) {
+            continue;
+        }
+
+        if (!buf->refs) {
+            blk_lru_remove(buf);
+        }
+
+        if (blk_submit(buf, 1) && !buf->refs) {
+            blk_lru_append(buf);
+        }
+    }
+
+    ARRAY_FOREACH(blk_bufs, i) {
+        buf = &blk_bufs[i];
+
+        if (buf->dev == dev) {
+            blk_wait(buf);
+            ret |= buf->dirty;
+        }
+    }
+
+    cpu_set_flags(flags);
+
+    return ret ? -1 : 0;
+}
+
+/* print counters of all devices to a buffer. return length of the text */
+size_t
+blk_stats_print(char *buf, size_t size)
+{
+    struct blk_stats *st;
+    size_t len = 0;
+
+    ARRAY_FOREACH(blkdevs, i) {
+        if (!blkdevs[i].active || len >= size) {
+            continue;
+        }
+
+        st = &blkdevs[i].stats;
+        len += snprintf(buf + len, size - len,
+                        "%s: %lu hits, %lu misses, %lu readahead, "
+                        "read %lu KiB in %lu ms, written %lu KiB in %lu ms\n",
+                        blkdevs[i].name, st->hits, st->misses, st->readahead,
+                        st->read_bytes / 1024, st->read_msecs,
+                        st->write_bytes / 1024, st->write_msecs);
+    }
+
+    return (len < size) ? len : size;
+}
+
+/* initialize the device table and the buffer cache */
+void
+blk_init(void)
+{
+    uint8_t *data = kheap_alloc((BLK_BUF_COUNT + 1) * BLK_SIZE);
+
+    kassert(data, "cannot allocate the buffer cache");
+
+    // aligned buffers never cross a physical frame, so drivers can dma to them
+    data = (uint8_t *)(((uintptr_t)data + BLK_SIZE - 1) & ~(uintptr_t)(BLK_SIZE - 1));
+
+    ARRAY_POOL_INIT(blkdevs);
+    ARRAY_HASH_INIT(blkdevs);
+
+    blk_lru_head = ARRAY_INDEX_NONE;
+    blk_lru_tail = ARRAY_INDEX_NONE;
+
+    ARRAY_FOREACH(blk_bufs, i) {
+        memset(&blk_bufs[i], 0, sizeof(blk_bufs[i]));
+        blk_bufs[i].dev = -1;
+        blk_bufs[i].data = data + i * BLK_SIZE;
+        blk_buckets[i] = ARRAY_INDEX_NONE;
+        blk_lru_append(&blk_bufs[i]);
+    }
+}
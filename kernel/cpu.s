@@ -9,9 +9,16 @@
 
 [global cpu_inb]
 [global cpu_outb]
+[global cpu_inw]
+[global cpu_outw]
+[global cpu_inl]
+[global cpu_outl]
+[global cpu_insw]
+[global cpu_outsw]
 [global cpu_invlpg]
 [global cpu_cli]
 [global cpu_sti]
+[global cpu_idle]
 [global cpu_task_switch]
 [global cpu_get_flags]
 [global cpu_set_flags]
@@ -30,6 +37,48 @@ cpu_outb:
   out dx, al
   ret
 
+; input a word from a port
+cpu_inw:
+  mov dx, di
+  in ax, dx
+  movzx eax, ax
+  ret
+
+; output a word to a port
+cpu_outw:
+  mov ax, si
+  mov dx, di
+  out dx, ax
+  ret
+
+; input a double word from a port
+cpu_inl:
+  mov dx, di
+  in eax, dx
+  ret
+
+; output a double word to a port
+cpu_outl:
+  mov eax, esi
+  mov dx, di
+  out dx, eax
+  ret
+
+; input words from a port to a buffer
+cpu_insw:
+  mov rcx, rdx
+  mov dx, di
+  mov rdi, rsi
+  rep insw
+  ret
+
+; output words from a buffer to a port
+cpu_outsw:
+  mov rcx, rdx
+  mov dx, di
+  rep outsw
+  ret
+
 ; invalidate a TLB entry
 cpu_invlpg:
   invlpg [rdi]
@@ -57,6 +106,14 @@ cpu_sti:
   sti
   ret
 
+; wait for an interrupt with interrupts enabled only while halted,
+; sti takes effect after hlt so no wakeup can be missed in between
+cpu_idle:
+  sti
+  hlt
+  cli
+  ret
+
 ; trigger task-switching interrupt
 cpu_task_switch:
   int 0x31
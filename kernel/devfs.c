@@ -15,7 +15,11 @@ enum {
     DEVFS_NODE_VT       = 1,
     DEVFS_NODE_KBD      = 2,
     DEVFS_NODE_TIME     = 3,
-    DEVFS_NODE_COUNT    = 4,
+    DEVFS_NODE_BLKSTAT  = 4,
+    DEVFS_NODE_TTYS0    = 5,
+    DEVFS_NODE_KMSG     = 6,
+    DEVFS_NODE_VT0      = 7,        // first of VT_COUNT consoles
+    DEVFS_NODE_COUNT    = DEVFS_NODE_VT0 + VT_COUNT,
 };
 
 /* private functions */
@@ -23,15 +27,24 @@ static int devfs_open(uintptr_t sbh, uintptr_t inh);
 static int devfs_close(struct file *file);
 static ssize_t devfs_read_kbd(struct file *file, void *buf, size_t nbyte);
 static ssize_t devfs_read_time(struct file *file, void *buf, size_t nbyte);
+static ssize_t devfs_read_blkstat(struct file *file, void *buf, size_t nbyte);
+static ssize_t devfs_read_kmsg(struct file *file, void *buf, size_t nbyte);
 static ssize_t devfs_read_dir(struct file *file, void *buf, size_t nbyte);
 static ssize_t devfs_read(struct file *file, void *buf, size_t nbyte);
 static ssize_t devfs_write(struct file *file, const void *buf, size_t nbyte);
+static void devfs_load_file_info(struct file_info *info, uintptr_t inh);
+static int devfs_stat(struct file *file, struct file_info *info);
+static int devfs_seek(struct file *file, size_t pos);
+static int devfs_poll(struct file *file);
 
 /* file operations */
 static struct file_ops devfs_file_ops = {
     .close_fn = &devfs_close,
     .read_fn = &devfs_read,
     .write_fn = &devfs_write,
+    .stat_fn = &devfs_stat,
+    .seek_fn = &devfs_seek,
+    .poll_fn = &devfs_poll,
 };
 
 /* vfs operations */
@@ -39,17 +52,31 @@ static struct vfs_ops devfs_ops = {
     .open_fn = &devfs_open,
 };
 
+/* open ttyS0 file objects, while there are none kbd reads serial input too */
+static size_t devfs_ttys0_files = 0;
+
 /* initialize a file object for specified superblock and inode */
 static int
 devfs_open(uintptr_t sbh, uintptr_t inh) 
 {
-    return file_new(sbh, inh, &devfs_file_ops);
+    int fd = file_new(sbh, inh, &devfs_file_ops);
+
+    if (fd >= 0 && inh == DEVFS_NODE_TTYS0) {
+        devfs_ttys0_files++;
+    }
+
+    return fd;
 }
 
 /* close a file */
 static int
 devfs_close(struct file *file)
 {
+    // pending serial input goes to kbd readers again
+    if (file->inh == DEVFS_NODE_TTYS0 && !--devfs_ttys0_files) {
+        file_poll_wakeup();
+    }
+
     file_release(file);
     return 0;
 }
@@ -60,12 +87,18 @@ devfs_read_kbd(struct file *file, void *buf, size_t nbyte)
 {
     uint16_t key;
 
-    if (nbyte < sizeof(key)) {
+    // keys go to tasks of the visible console
+    if (nbyte < sizeof(key) || task_vt() != vt_active()) {
         return 0;
     }
 
+    // without a key pressed, take a character from the serial console,
+    // unless ttyS0 is open and so its only reader
     if (kbd_read(&key)) {
-        return 0;
+        if (devfs_ttys0_files || !uart_pending() || !uart_read(&key, 1)) {
+            return 0;
+        }
+        key = (key & 0xFF) == 0x7F ? '\b' : key & 0xFF;
     }
 
     memcpy(buf, &key, sizeof(key));
@@ -97,37 +130,89 @@ devfs_read_time(struct file *file, void *buf, size_t nbyte)
     return size;
 }
 
-/* read directory entry */
+/* read block device counters */
 static ssize_t
-devfs_read_dir(struct file *file, void *buf, size_t nbyte)
+devfs_read_blkstat(struct file *file, void *buf, size_t nbyte)
 {
-    if (nbyte < sizeof(struct file_info)) {
-        return 0;
-    }
+    char tmpbuf[512];
+    size_t size;
 
-    if (file->inh) {
+    if (file->pos > 0) {
         return 0;
     }
 
-    file->pos++;
+    size = blk_stats_print(tmpbuf, sizeof(tmpbuf));
+    size = (size < nbyte) ? size : nbyte;
 
-    if (file->pos >= DEVFS_NODE_COUNT) {
-        return 0;
-    }
+    memcpy(buf, tmpbuf, size);
 
-    struct file_info *info = (struct file_info *)buf;
+    file->pos += size;
 
-    info->inh = file->pos;
+    return size;
+}
+
+/* read kernel log records, the position is the next sequence number */
+static ssize_t
+devfs_read_kmsg(struct file *file, void *buf, size_t nbyte)
+{
+    uint64_t seq = file->pos;
+    size_t size;
+
+    size = klog_read(&seq, buf, nbyte);
+    file->pos = seq;
+
+    return size;
+}
+
+/* load a file info structure for a specified node */
+static void
+devfs_load_file_info(struct file_info *info, uintptr_t inh)
+{
+    memset(info, 0, sizeof(*info));
+
+    info->inh = inh;
     info->type = FT_REG;
 
-    switch(file->pos) {
+    switch(inh) {
+    case DEVFS_NODE_ROOT: info->type = FT_DIR; break;
     case DEVFS_NODE_VT: memcpy(info->name, "vt", 3); break;
     case DEVFS_NODE_KBD: memcpy(info->name, "kbd", 4); break;
     case DEVFS_NODE_TIME: memcpy(info->name, "time", 5); break;
+    case DEVFS_NODE_BLKSTAT: memcpy(info->name, "blkstat", 8); break;
+    case DEVFS_NODE_TTYS0: memcpy(info->name, "ttyS0", 6); break;
+    case DEVFS_NODE_KMSG: memcpy(info->name, "kmsg", 5); break;
     default: break;
     }
 
-    return sizeof(struct file_info);
+    if (inh >= DEVFS_NODE_VT0 && inh < DEVFS_NODE_COUNT) {
+        (void)snprintf(info->name, sizeof(info->name), "vt%d", (int)(inh - DEVFS_NODE_VT0));
+    }
+}
+
+/* read as many directory entries as fit in a buffer */
+static ssize_t
+devfs_read_dir(struct file *file, void *buf, size_t nbyte)
+{
+    struct file_info info;
+    size_t count = 0;
+
+    if (file->inh) {
+        return 0;
+    }
+
+    while (nbyte - count >= sizeof(struct file_info)) {
+        if (file->pos + 1 >= DEVFS_NODE_COUNT) {
+            break;
+        }
+
+        file->pos++;
+
+        devfs_load_file_info(&info, file->pos);
+        memcpy((uint8_t *)buf + count, &info, sizeof(info));
+        count += sizeof(info);
+    }
+
+    return count;
 }
 
 /* read data to a memory buffer */
@@ -138,6 +223,9 @@ devfs_read(struct file *file, void *buf, size_t nbyte)
     case DEVFS_NODE_ROOT: return devfs_read_dir(file, buf, nbyte);
     case DEVFS_NODE_KBD: return devfs_read_kbd(file, buf, nbyte);
     case DEVFS_NODE_TIME: return devfs_read_time(file, buf, nbyte);
+    case DEVFS_NODE_BLKSTAT: return devfs_read_blkstat(file, buf, nbyte);
+    case DEVFS_NODE_TTYS0: return uart_read(buf, nbyte);
+    case DEVFS_NODE_KMSG: return devfs_read_kmsg(file, buf, nbyte);
     default: return 0;
     }
 }
@@ -146,12 +234,51 @@ devfs_read(struct file *file, void *buf, size_t nbyte)
 static ssize_t
 devfs_write(struct file *file, const void *buf, size_t nbyte)
 {
+    if (file->inh >= DEVFS_NODE_VT0 && file->inh < DEVFS_NODE_COUNT) {
+        return vt_write(file->inh - DEVFS_NODE_VT0, buf, nbyte);
+    }
+
     switch (file->inh) {
-    case DEVFS_NODE_VT: return vt_write((char *)buf, nbyte);
+    case DEVFS_NODE_VT: return vt_write(task_vt(), buf, nbyte);
+    case DEVFS_NODE_TTYS0: uart_write(buf, nbyte); return nbyte;
+    case DEVFS_NODE_KMSG: return klog_configure(buf, nbyte);
     default: return -1;
     }
 }
 
+/* load a file info structure of an open file */
+static int
+devfs_stat(struct file *file, struct file_info *info)
+{
+    devfs_load_file_info(info, file->inh);
+    return 0;
+}
+
+/* validate a new position, devices can only be rewound */
+static int
+devfs_seek(struct file *file, size_t pos)
+{
+    return pos ? -1 : 0;
+}
+
+/* return events a device is ready for */
+static int
+devfs_poll(struct file *file)
+{
+    if (file->inh >= DEVFS_NODE_VT0 && file->inh < DEVFS_NODE_COUNT) {
+        return POLL_OUT;
+    }
+
+    switch (file->inh) {
+    case DEVFS_NODE_VT: return POLL_OUT;
+    case DEVFS_NODE_KBD:
+        return (kbd_pending() || (!devfs_ttys0_files && uart_pending())) &&
+               task_vt() == vt_active() ? POLL_IN : 0;
+    case DEVFS_NODE_TTYS0: return uart_pending() ? POLL_IN | POLL_OUT : POLL_OUT;
+    default: return POLL_IN;
+    }
+}
+
 /* mount a dev filesystem */
 int
 devfs_mount(const char *volume)
@@ -0,0 +1,748 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/ext2.c - read-only ext2 filesystem driver
+ *
+ * the filesystem is read from a block device through the buffer cache,
+ * either from the first linux partition of an mbr partitioned disk or
+ * from the whole device. block group descriptors are loaded once at
+ * mount time and decoded inodes are kept in a small lru cache shared by
+ * all mounted filesystems, so a lookup only reads directory blocks.
+ * inode handles are inode numbers.
+ */
+
+#define KLOG_SUBSYS KLOG_SYS_FS
+
+#include <kernel/kernel.h>
+
+/* partition table */
+enum {
+    MBR_PART_TABLE      = 446,
+    MBR_PART_COUNT      = 4,
+    MBR_PART_LINUX      = 0x83,
+    MBR_SIGNATURE       = 0xAA55,
+};
+
+/* on-disk constants */
+enum {
+    EXT2_SB_OFFSET      = 1024,
+    EXT2_MAGIC          = 0xEF53,
+    EXT2_ROOT_INO       = 2,
+    EXT2_GOOD_OLD_INODE = 128,
+    EXT2_NDIR_BLOCKS    = 12,
+    EXT2_N_BLOCKS       = 15,
+    EXT2_INCOMPAT_FTYPE = 0x0002,   // the only supported incompatible feature
+
+    EXT2_S_IFMT         = 0xF000,
+    EXT2_S_IFDIR        = 0x4000,
+    EXT2_S_IFREG        = 0x8000,
+};
+
+enum {
+    EXT2_MOUNT_COUNT    = 2,        // max number of mounted filesystems
+    EXT2_ICACHE_COUNT   = 32,       // amount of cached inodes
+};
+
+/* superblock, only the used part */
+struct ext2_super {
+    uint32_t inodes_count;
+    uint32_t blocks_count;
+    uint32_t r_blocks_count;
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t first_data_block;
+    uint32_t log_block_size;
+    uint32_t log_frag_size;
+    uint32_t blocks_per_group;
+    uint32_t frags_per_group;
+    uint32_t inodes_per_group;
+    uint32_t mtime;
+    uint32_t wtime;
+    uint16_t mnt_count;
+    uint16_t max_mnt_count;
+    uint16_t magic;
+    uint16_t state;
+    uint16_t errors;
+    uint16_t minor_rev_level;
+    uint32_t lastcheck;
+    uint32_t checkinterval;
+    uint32_t creator_os;
+    uint32_t rev_level;
+    uint16_t def_resuid;
+    uint16_t def_resgid;
+    uint32_t first_ino;
+    uint16_t inode_size;
+    uint16_t block_group_nr;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+};
+
+/* block group descriptor */
+struct ext2_group {
+    uint32_t block_bitmap;
+    uint32_t inode_bitmap;
+    uint32_t inode_table;
+    uint16_t free_blocks_count;
+    uint16_t free_inodes_count;
+    uint16_t used_dirs_count;
+    uint16_t pad;
+    uint32_t reserved[3];
+};
+
+/* inode, the part common to all revisions */
+struct ext2_inode {
+    uint16_t mode;
+    uint16_t uid;
+    uint32_t size;
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+    uint32_t dtime;
+    uint16_t gid;
+    uint16_t links_count;
+    uint32_t blocks;
+    uint32_t flags;
+    uint32_t osd1;
+    uint32_t block[EXT2_N_BLOCKS];
+    uint32_t generation;
+    uint32_t file_acl;
+    uint32_t size_high;
+    uint32_t faddr;
+    uint8_t osd2[12];
+};
+
+/* directory entry header, followed by the name */
+struct ext2_dirent {
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+};
+
+/* mounted filesystem */
+struct ext2_fs {
+    uint8_t active;
+    int dev;
+    uint64_t offset;                // start of the filesystem on the device
+    size_t bsize;
+    size_t inode_size;
+    uint32_t inodes_count;
+    uint32_t inodes_per_group;
+    uint32_t group_count;
+    struct ext2_group *groups;      // cached block group descriptors
+};
+
+/* cached inode */
+struct ext2_icache {
+    uint8_t active;
+    struct ext2_fs *fs;
+    uint32_t ino;
+    uint64_t used;
+    struct ext2_inode inode;
+};
+
+/* private functions */
+static int ext2_read_bytes(struct ext2_fs *fs, void *buf, size_t nbyte, uint64_t off);
+static int ext2_load_inode(struct ext2_fs *fs, uint32_t ino, struct ext2_inode *dest);
+static int ext2_inode_type(struct ext2_inode *inode);
+static uint64_t ext2_inode_size(struct ext2_inode *inode);
+static int ext2_bmap(struct ext2_fs *fs, struct ext2_inode *inode, uint32_t lblk,
+                     uint32_t *dest);
+static uint32_t ext2_bmap_run(struct ext2_fs *fs, struct ext2_inode *inode,
+                              uint32_t lblk, uint32_t max, uint32_t *dest);
+static ssize_t ext2_pread_inode(struct ext2_fs *fs, struct ext2_inode *inode,
+                                void *buf, size_t nbyte, uint64_t off);
+static int ext2_next_dirent(struct ext2_fs *fs, struct ext2_inode *dir, size_t *pos,
+                            uint32_t *ino, char *name);
+static int ext2_load_file_info(struct file_info *info, struct ext2_fs *fs,
+                               uint32_t ino, const char *name);
+static int ext2_lookup(uintptr_t sbh, uintptr_t inh, const char *name,
+                       struct file_info *dest);
+static int ext2_open(uintptr_t sbh, uintptr_t inh);
+static int ext2_close(struct file *file);
+static ssize_t ext2_pread(struct file *file, void *buf, size_t nbyte, size_t off);
+static ssize_t ext2_read_dir(struct file *file, void *buf, size_t nbyte);
+static ssize_t ext2_read(struct file *file, void *buf, size_t nbyte);
+static ssize_t ext2_write(struct file *file, const void *buf, size_t nbyte);
+static int ext2_stat(struct file *file, struct file_info *info);
+static int ext2_seek(struct file *file, size_t pos);
+static int ext2_advise(struct file *file, size_t off, size_t len, int advice);
+static uint64_t ext2_find_partition(int dev);
+
+/* file operations */
+static struct file_ops ext2_file_ops = {
+    .close_fn = &ext2_close,
+    .read_fn = &ext2_read,
+    .write_fn = &ext2_write,
+    .stat_fn = &ext2_stat,
+    .seek_fn = &ext2_seek,
+    .pread_fn = &ext2_pread,
+    .advise_fn = &ext2_advise,
+};
+
+/* vfs operations */
+static struct vfs_ops ext2_ops = {
+    .open_fn = &ext2_open,
+    .lookup_fn = &ext2_lookup,
+};
+
+/* mounted filesystems and the inode cache */
+static struct ext2_fs ext2_fss[EXT2_MOUNT_COUNT];
+static struct ext2_icache ext2_icache[EXT2_ICACHE_COUNT];
+static uint64_t ext2_icache_tick;
+
+/* read bytes at a given offset of a filesystem. return 0 on success */
+static int
+ext2_read_bytes(struct ext2_fs *fs, void *buf, size_t nbyte, uint64_t off)
+{
+    return blk_read(fs->dev, buf, nbyte, fs->offset + off) == (ssize_t)nbyte ? 0 : -1;
+}
+
+/*
+ * load an inode, from the cache or into its least recently used slot.
+ * return 0 on success
+ */
+static int
+ext2_load_inode(struct ext2_fs *fs, uint32_t ino, struct ext2_inode *dest)
+{
+    struct ext2_icache *ic = &ext2_icache[0];
+    struct ext2_group *group;
+    uint32_t index;
+
+    ARRAY_FOREACH(ext2_icache, i) {
+        if (ext2_icache[i].active && ext2_icache[i].fs == fs &&
+            ext2_icache[i].ino == ino) {
+            ext2_icache[i].used = ++ext2_icache_tick;
+            memcpy(dest, &ext2_icache[i].inode, sizeof(*dest));
+            return 0;
+        }
+        if (!ext2_icache[i].active || ext2_icache[i].used < ic->used) {
+            ic = &ext2_icache[i];
+        }
+    }
+
+    if (!ino || ino > fs->inodes_count) {
+        return -1;
+    }
+
+    group = &fs->groups[(ino - 1) / fs->inodes_per_group];
+    index = (ino - 1) % fs->inodes_per_group;
+
+    // reading may block, the slot is only filled afterwards
+    if (ext2_read_bytes(fs, dest, sizeof(*dest),
+                        (uint64_t)group->inode_table * fs->bsize + index * fs->inode_size)) {
+        return -1;
+    }
+
+    ic->active = 1;
+    ic->fs = fs;
+    ic->ino = ino;
+    ic->used = ++ext2_icache_tick;
+    memcpy(&ic->inode, dest, sizeof(*dest));
+
+    return 0;
+}
+
+/* return the file type of an inode */
+static int
+ext2_inode_type(struct ext2_inode *inode)
+{
+    switch (inode->mode & EXT2_S_IFMT) {
+    case EXT2_S_IFREG: return FT_REG;
+    case EXT2_S_IFDIR: return FT_DIR;
+    default: return FT_UNK;
+    }
+}
+
+/* return size of an inode, regular files may use the high 32 bits */
+static uint64_t
+ext2_inode_size(struct ext2_inode *inode)
+{
+    if (ext2_inode_type(inode) == FT_REG) {
+        return inode->size | ((uint64_t)inode->size_high << 32);
+    }
+
+    return inode->size;
+}
+
+/*
+ * map a block of a file to a block of the filesystem, going through the
+ * indirect blocks if needed. a hole maps to 0. return 0 on success
+ */
+static int
+ext2_bmap(struct ext2_fs *fs, struct ext2_inode *inode, uint32_t lblk,
+          uint32_t *dest)
+{
+    uint64_t per = fs->bsize / sizeof(uint32_t);
+    uint64_t n = lblk;
+    uint64_t span = 1;
+    uint32_t blk;
+    int level;
+
+    if (n < EXT2_NDIR_BLOCKS) {
+        *dest = inode->block[n];
+        return 0;
+    }
+
+    n -= EXT2_NDIR_BLOCKS;
+
+    // find the level of indirection covering the block
+    for (level = 1; level <= 3; ++level) {
+        span *= per;
+        if (n < span) {
+            break;
+        }
+        n -= span;
+    }
+
+    if (level > 3) {
+        return -1;
+    }
+
+    blk = inode->block[EXT2_NDIR_BLOCKS + level - 1];
+
+    for (; level && blk; --level) {
+        span /= per;
+
+        if (ext2_read_bytes(fs, &blk, sizeof(blk),
+                            (uint64_t)blk * fs->bsize + (n / span) * sizeof(blk))) {
+            return -1;
+        }
+
+        n %= span;
+    }
+
+    *dest = blk;
+
+    return 0;
+}
+
+/*
+ * map up to max blocks of a file starting at a given one, as long as they
+ * are contiguous on the disk. a hole is a run of one block mapped to 0.
+ * return length of the run, or 0 on error
+ */
+static uint32_t
+ext2_bmap_run(struct ext2_fs *fs, struct ext2_inode *inode, uint32_t lblk,
+              uint32_t max, uint32_t *dest)
+{
+    uint32_t n = 1;
+    uint32_t next;
+
+    if (ext2_bmap(fs, inode, lblk, dest)) {
+        return 0;
+    }
+
+    while (*dest && n < max && !ext2_bmap(fs, inode, lblk + n, &next) && next == *dest + n) {
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * read data at a given offset of an inode. runs of contiguous blocks are
+ * read with a single request, so the block layer can see sequential reads
+ */
+static ssize_t
+ext2_pread_inode(struct ext2_fs *fs, struct ext2_inode *inode, void *buf,
+                 size_t nbyte, uint64_t off)
+{
+    uint64_t size = ext2_inode_size(inode);
+    uint32_t pblk, n;
+    size_t done = 0;
+    size_t ofs, len;
+
+    if (off >= size) {
+        return 0;
+    }
+
+    if (nbyte > size - off) {
+        nbyte = size - off;
+    }
+
+    while (done < nbyte) {
+        ofs = (off + done) % fs->bsize;
+        n = (ofs + nbyte - done + fs->bsize - 1) / fs->bsize;
+
+        if (!(n = ext2_bmap_run(fs, inode, (off + done) / fs->bsize, n, &pblk))) {
+            break;
+        }
+
+        len = n * fs->bsize - ofs;
+        if (len > nbyte - done) {
+            len = nbyte - done;
+        }
+
+        if (!pblk) {
+            memset((uint8_t *)buf + done, 0, len);
+        } else if (ext2_read_bytes(fs, (uint8_t *)buf + done, len,
+                                   (uint64_t)pblk * fs->bsize + ofs)) {
+            break;
+        }
+
+        done += len;
+    }
+
+    return done ? (ssize_t)done : -1;
+}
+
+/*
+ * read the next used entry of a directory starting at a given position
+ * and advance the position past it. return 1 if an entry was read, 2 if
+ * its name had to be cut, 0 at the end of the directory or -1 on error
+ */
+static int
+ext2_next_dirent(struct ext2_fs *fs, struct ext2_inode *dir, size_t *pos,
+                 uint32_t *ino, char *name)
+{
+    uint64_t size = ext2_inode_size(dir);
+    struct ext2_dirent de;
+    size_t len;
+
+    while (*pos + sizeof(de) <= size) {
+        if (ext2_pread_inode(fs, dir, &de, sizeof(de), *pos) != sizeof(de) ||
+            de.rec_len < sizeof(de) || *pos + de.rec_len > size) {
+            return -1;
+        }
+
+        // names too long for a file info are cut
+        len = (de.name_len < NAME_MAX - 1) ? de.name_len : NAME_MAX - 1;
+
+        if (de.inode && ext2_pread_inode(fs, dir, name, len, *pos + sizeof(de)) != (ssize_t)len) {
+            return -1;
+        }
+
+        *pos += de.rec_len;
+
+        if (de.inode) {
+            name[len] = 0;
+            *ino = de.inode;
+            return (de.name_len < NAME_MAX) ? 1 : 2;
+        }
+    }
+
+    return 0;
+}
+
+/* load a file info structure for a specified inode. return 0 on success */
+static int
+ext2_load_file_info(struct file_info *info, struct ext2_fs *fs, uint32_t ino,
+                    const char *name)
+{
+    struct ext2_inode inode;
+
+    if (ext2_load_inode(fs, ino, &inode)) {
+        return -1;
+    }
+
+    memset(info, 0, sizeof(*info));
+
+    info->inh = ino;
+    info->type = ext2_inode_type(&inode);
+    info->size = (info->type == FT_REG) ? ext2_inode_size(&inode) : 0;
+    strncpy(info->name, name, NAME_MAX - 1);
+
+    return 0;
+}
+
+/* find an entry with a given name in a specified directory */
+static int
+ext2_lookup(uintptr_t sbh, uintptr_t inh, const char *name,
+            struct file_info *dest)
+{
+    struct ext2_fs *fs = (struct ext2_fs *)sbh;
+    struct ext2_inode dir;
+    char buf[NAME_MAX];
+    size_t pos = 0;
+    uint32_t ino;
+    int ret;
+
+    if (ext2_load_inode(fs, inh ? inh : EXT2_ROOT_INO, &dir) ||
+        ext2_inode_type(&dir) != FT_DIR) {
+        return -1;
+    }
+
+    // entries with cut names can't match
+    while ((ret = ext2_next_dirent(fs, &dir, &pos, &ino, buf)) > 0) {
+        if (ret == 1 && !strcmp(buf, name)) {
+            return ext2_load_file_info(dest, fs, ino, name);
+        }
+    }
+
+    return -1;
+}
+
+/* initialize a file object for a specified superblock and inode */
+static int
+ext2_open(uintptr_t sbh, uintptr_t inh)
+{
+    struct ext2_inode inode;
+
+    if (!inh) {
+        inh = EXT2_ROOT_INO;
+    }
+
+    if (ext2_load_inode((struct ext2_fs *)sbh, inh, &inode)) {
+        return -1;
+    }
+
+    return file_new(sbh, inh, &ext2_file_ops);
+}
+
+/* close a file */
+static int
+ext2_close(struct file *file)
+{
+    file_release(file);
+    return 0;
+}
+
+/* read from a given offset of a regular file to a buffer */
+static ssize_t
+ext2_pread(struct file *file, void *buf, size_t nbyte, size_t off)
+{
+    struct ext2_fs *fs = (struct ext2_fs *)file->sbh;
+    struct ext2_inode inode;
+
+    if (ext2_load_inode(fs, file->inh, &inode) || ext2_inode_type(&inode) != FT_REG) {
+        return -1;
+    }
+
+    if (!nbyte) {
+        return 0;
+    }
+
+    return ext2_pread_inode(fs, &inode, buf, nbyte, off);
+}
+
+/*
+ * read as many directory entries as fit in a buffer, skipping . and ..
+ * the position is the offset of the next entry in the directory
+ */
+static ssize_t
+ext2_read_dir(struct file *file, void *buf, size_t nbyte)
+{
+    struct ext2_fs *fs = (struct ext2_fs *)file->sbh;
+    struct ext2_inode dir;
+    struct file_info info;
+    char name[NAME_MAX];
+    size_t count = 0;
+    size_t pos;
+    uint32_t ino;
+
+    if (ext2_load_inode(fs, file->inh, &dir)) {
+        return -1;
+    }
+
+    while (nbyte - count >= sizeof(info)) {
+        pos = file->pos;
+
+        if (ext2_next_dirent(fs, &dir, &pos, &ino, name) <= 0) {
+            break;
+        }
+
+        file->pos = pos;
+
+        if (!strcmp(name, ".") || !strcmp(name, "..") ||
+            ext2_load_file_info(&info, fs, ino, name)) {
+            continue;
+        }
+
+        memcpy((uint8_t *)buf + count, &info, sizeof(info));
+        count += sizeof(info);
+    }
+
+    return count;
+}
+
+/* read data from a file to a buffer */
+static ssize_t
+ext2_read(struct file *file, void *buf, size_t nbyte)
+{
+    struct ext2_inode inode;
+    ssize_t ret;
+
+    if (ext2_load_inode((struct ext2_fs *)file->sbh, file->inh, &inode)) {
+        return -1;
+    }
+
+    switch (ext2_inode_type(&inode)) {
+    case FT_DIR:
+        return ext2_read_dir(file, buf, nbyte);
+    case FT_REG:
+        if ((ret = ext2_pread(file, buf, nbyte, file->pos)) > 0) {
+            file->pos += ret;
+        }
+        return ret;
+    default:
+        return -1;
+    }
+}
+
+/* write to a file (not supported, returns error) */
+static ssize_t
+ext2_write(struct file *file, const void *buf, size_t nbyte)
+{
+    return -1;
+}
+
+/* load a file info structure of an open file, without its name */
+static int
+ext2_stat(struct file *file, struct file_info *info)
+{
+    return ext2_load_file_info(info, (struct ext2_fs *)file->sbh, file->inh, "");
+}
+
+/* validate a new position. directories can only be rewound */
+static int
+ext2_seek(struct file *file, size_t pos)
+{
+    struct ext2_inode inode;
+
+    if (ext2_load_inode((struct ext2_fs *)file->sbh, file->inh, &inode)) {
+        return -1;
+    }
+
+    switch (ext2_inode_type(&inode)) {
+    case FT_REG: return 0;
+    case FT_DIR: return pos ? -1 : 0;
+    default: return -1;
+    }
+}
+
+/* start fetching blocks of a range of a regular file into the cache */
+static int
+ext2_advise(struct file *file, size_t off, size_t len, int advice)
+{
+    struct ext2_fs *fs = (struct ext2_fs *)file->sbh;
+    struct ext2_inode inode;
+    uint64_t size, last;
+    uint32_t lblk, pblk, n;
+
+    if (ext2_load_inode(fs, file->inh, &inode) || ext2_inode_type(&inode) != FT_REG) {
+        return -1;
+    }
+
+    size = ext2_inode_size(&inode);
+
+    if (advice != FILE_ADV_WILLNEED || !len || off >= size) {
+        return 0;
+    }
+
+    last = ((off + len < size) ? off + len : size) - 1;
+
+    // one request per run of contiguous blocks, holes need no fetching
+    for (lblk = off / fs->bsize; lblk <= last / fs->bsize; lblk += n) {
+        if (!(n = ext2_bmap_run(fs, &inode, lblk, last / fs->bsize - lblk + 1, &pblk))) {
+            return -1;
+        }
+
+        if (pblk) {
+            blk_prefetch(fs->dev, fs->offset + (uint64_t)pblk * fs->bsize, n * fs->bsize);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * return the offset of the first linux partition of a device, or 0 if
+ * the device is not partitioned
+ */
+static uint64_t
+ext2_find_partition(int dev)
+{
+    uint8_t mbr[BLK_SECTOR_SIZE];
+    uint8_t *part;
+    uint32_t start;
+
+    if (blk_read(dev, mbr, sizeof(mbr), 0) != sizeof(mbr) ||
+        (mbr[510] | (mbr[511] << 8)) != MBR_SIGNATURE) {
+        return 0;
+    }
+
+    for (int i = 0; i < MBR_PART_COUNT; ++i) {
+        part = mbr + MBR_PART_TABLE + i * 16;
+        start = part[8] | (part[9] << 8) | (part[10] << 16) | ((uint32_t)part[11] << 24);
+
+        if (part[4] == MBR_PART_LINUX && start) {
+            return (uint64_t)start * BLK_SECTOR_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+/* mount an ext2 filesystem from a block device */
+int
+ext2_mount(const char *devname, const char *volume)
+{
+    struct ext2_super sb;
+    struct ext2_fs *fs = NULL;
+    size_t gsize;
+    int dev;
+
+    if ((dev = blk_find(devname)) < 0) {
+        return -1;
+    }
+
+    ARRAY_FOREACH(ext2_fss, i) {
+        if (!ext2_fss[i].active) {
+            fs = &ext2_fss[i];
+            break;
+        }
+    }
+
+    if (!fs) {
+        printk(KERN_WARN, "ext2: too many mounted filesystems\n");
+        return -1;
+    }
+
+    fs->dev = dev;
+    fs->offset = ext2_find_partition(dev);
+
+    if (ext2_read_bytes(fs, &sb, sizeof(sb), EXT2_SB_OFFSET) || sb.magic != EXT2_MAGIC) {
+        return -1;
+    }
+
+    if ((sb.feature_incompat & ~EXT2_INCOMPAT_FTYPE) || sb.log_block_size > 2 ||
+        !sb.blocks_per_group || !sb.inodes_per_group) {
+        printk(KERN_WARN, "ext2: unsupported filesystem on %s\n", devname);
+        return -1;
+    }
+
+    fs->bsize = 1024 << sb.log_block_size;
+    fs->inode_size = sb.rev_level ? sb.inode_size : EXT2_GOOD_OLD_INODE;
+    fs->inodes_count = sb.inodes_count;
+    fs->inodes_per_group = sb.inodes_per_group;
+    fs->group_count = (sb.inodes_count + sb.inodes_per_group - 1) / sb.inodes_per_group;
+
+    if (fs->inode_size < EXT2_GOOD_OLD_INODE) {
+        return -1;
+    }
+
+    // the descriptor table follows the block with the superblock
+    gsize = fs->group_count * sizeof(struct ext2_group);
+
+    if (!(fs->groups = kheap_alloc(gsize)) ||
+        ext2_read_bytes(fs, fs->groups, gsize, (uint64_t)(sb.first_data_block + 1) * fs->bsize)) {
+        return -1;
+    }
+
+    if (vfs_mount(volume, &ext2_ops, (uintptr_t)fs)) {
+        kheap_free(fs->groups);
+        return -1;
+    }
+
+    fs->active = 1;
+
+    printk(KERN_INFO, "ext2: %s mounted at %s, %u groups of %u KiB blocks\n",
+           devname, volume, fs->group_count, (uint32_t)(fs->bsize / 1024));
+
+    return 0;
+}
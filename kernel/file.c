@@ -7,10 +7,186 @@
  * kernel/file.c - file routines
  */
 
+#define KLOG_SUBSYS KLOG_SYS_FS
+
 #include <kernel/kernel.h>
 
-/* fixed array of file objects */
-static struct file files[32];
+/* file limits */
+enum {
+    FILE_SPLICE_BUF = 512,      // bounce buffer for files which can't be mapped
+    FDTABLE_MAX     = 1024,     // max descriptors per task
+    FILE_RA_MIN     = 8192,     // first readahead window of sequential readers
+    FILE_RA_MAX     = 65536,    // max readahead window
+};
+
+/* private functions */
+static struct file *file_get(int fd);
+static struct file *file_hold(int fd);
+static int file_put(struct file *file);
+static int fdtable_grow(struct fdtable *fdt);
+static int fdtable_alloc(struct fdtable *fdt, struct file *file);
+static ssize_t file_write_all(struct file *file, const void *buf, size_t nbyte);
+static void file_readahead(struct file *file, size_t off, size_t count);
+
+/* array of open file objects, shared by descriptors of all tasks */
+static struct file files[64];
+static ARRAY_POOL_HEAD(files);
+
+/* channel of tasks blocked in file_poll() */
+static uint8_t file_pollers;
+
+/* initialize an empty descriptor table */
+void
+fdtable_init(struct fdtable *fdt)
+{
+    fdt->slots = fdt->inline_slots;
+    fdt->size = FDTABLE_INLINE;
+    fdt->free = 0;
+
+    for (int i = 0; i < fdt->size; ++i) {
+        fdt->slots[i].file = NULL;
+        fdt->slots[i].next_free = (i + 1 < fdt->size) ? i + 1 : -1;
+    }
+}
+
+/* double the size of a descriptor table. return 0 on success */
+static int
+fdtable_grow(struct fdtable *fdt)
+{
+    struct fd_slot *slots;
+    int size = fdt->size * 2;
+
+    if (size > FDTABLE_MAX) {
+        return -1;
+    }
+
+    if (!(slots = kheap_alloc(size * sizeof(*slots)))) {
+        return -1;
+    }
+
+    memcpy(slots, fdt->slots, fdt->size * sizeof(*slots));
+
+    for (int i = fdt->size; i < size; ++i) {
+        slots[i].file = NULL;
+        slots[i].next_free = (i + 1 < size) ? i + 1 : fdt->free;
+    }
+
+    if (fdt->slots != fdt->inline_slots) {
+        kheap_free(fdt->slots);
+    }
+
+    fdt->free = fdt->size;
+    fdt->slots = slots;
+    fdt->size = size;
+
+    return 0;
+}
+
+/* take a free descriptor for a given file. return descriptor or -1 */
+static int
+fdtable_alloc(struct fdtable *fdt, struct file *file)
+{
+    int fd;
+
+    if (fdt->free < 0 && fdtable_grow(fdt)) {
+        return -1;
+    }
+
+    fd = fdt->free;
+    fdt->free = fdt->slots[fd].next_free;
+    fdt->slots[fd].file = file;
+
+    return fd;
+}
+
+/* share all descriptors of one table with another, empty one */
+void
+fdtable_copy(struct fdtable *dst, struct fdtable *src)
+{
+    while (dst->size < src->size) {
+        if (fdtable_grow(dst)) {
+            return;
+        }
+    }
+
+    for (int fd = 0; fd < src->size; ++fd) {
+        if ((dst->slots[fd].file = src->slots[fd].file)) {
+            dst->slots[fd].file->refs++;
+        }
+    }
+
+    // rebuild the free list, lowest descriptors first
+    dst->free = -1;
+    for (int fd = dst->size - 1; fd >= 0; --fd) {
+        if (!dst->slots[fd].file) {
+            dst->slots[fd].next_free = dst->free;
+            dst->free = fd;
+        }
+    }
+}
+
+/* close all descriptors of a table and shrink it back to the inline slots */
+void
+fdtable_close_all(struct fdtable *fdt)
+{
+    for (int fd = 0; fd < fdt->size; ++fd) {
+        struct file *file = fdt->slots[fd].file;
+
+        if (file) {
+            fdt->slots[fd].file = NULL;
+            (void)file_put(file);
+        }
+    }
+
+    if (fdt->slots != fdt->inline_slots) {
+        kheap_free(fdt->slots);
+    }
+
+    fdtable_init(fdt);
+}
+
+/* return a file object for a descriptor of the current task or NULL */
+static struct file *
+file_get(int fd)
+{
+    struct fdtable *fdt = task_fdtable();
+
+    if (fd < 0 || fd >= fdt->size) {
+        return NULL;
+    }
+
+    return fdt->slots[fd].file;
+}
+
+/*
+ * return a file object for a descriptor of the current task with a new
+ * reference, so it stays open while a driver call blocks, or NULL
+ */
+static struct file *
+file_hold(int fd)
+{
+    struct file *file = file_get(fd);
+
+    if (file) {
+        file->refs++;
+    }
+
+    return file;
+}
+
+/*
+ * drop a reference to a file object, closing it with the last one.
+ * return the status of close_fn or 0
+ */
+static int
+file_put(struct file *file)
+{
+    if (--file->refs == 0) {
+        return file->ops->close_fn(file);
+    }
+
+    return 0;
+}
 
 /* 
  * initialize a new file object with given superblock handle,
@@ -19,51 +195,140 @@ static struct file files[32];
 int
 file_new(uintptr_t sbh, uintptr_t inh, struct file_ops *ops)
 {
-    struct file *file = ARRAY_TAKE(files);
+    struct file *file = ARRAY_POOL_TAKE(files);
+    int fd;
 
     if (!file) {
         printk(KERN_WARN, "too many files open\n");
         return -1;
     }
 
+    file->refs = 1;
     file->inh = inh;
     file->ops = ops;
     file->sbh = sbh;
     file->pos = 0;
+    file->advice = FILE_ADV_NORMAL;
+    file->ra_next = 0;
+    file->ra_end = 0;
+    file->ra_window = 0;
+
+    if ((fd = fdtable_alloc(task_fdtable(), file)) < 0) {
+        printk(KERN_WARN, "too many file descriptors\n");
+        ARRAY_POOL_RELEASE(files, file);
+        return -1;
+    }
 
-    return (file - files);
+    return fd;
 }
 
 /* release a file object */
 void
 file_release(struct file *file)
 {
-    ARRAY_RELEASE(file);
+    ARRAY_POOL_RELEASE(files, file);
 }
 
-/* close a file */
+/* duplicate a descriptor. return the new descriptor or -1 */
 int
-file_close(int fd)
+file_dup(int fd)
 {
     struct file *file;
     int ret;
 
-    file = &files[fd];
-    ret = file->ops->close_fn(file);
+    if (!(file = file_get(fd))) {
+        return -1;
+    }
+
+    if ((ret = fdtable_alloc(task_fdtable(), file)) >= 0) {
+        file->refs++;
+    }
 
     return ret;
 }
 
+/* close a file descriptor, and the file object with its last descriptor */
+int
+file_close(int fd)
+{
+    struct fdtable *fdt = task_fdtable();
+    struct file *file;
+
+    if (!(file = file_get(fd))) {
+        return -1;
+    }
+
+    fdt->slots[fd].file = NULL;
+    fdt->slots[fd].next_free = fdt->free;
+    fdt->free = fd;
+
+    return file_put(file);
+}
+
+/*
+ * advise the driver to fetch data ahead of a reader which continues where
+ * the previous read ended. the window doubles with each sequential read
+ * and the next one is advised once half of the previous one was consumed
+ */
+static void
+file_readahead(struct file *file, size_t off, size_t count)
+{
+    size_t end = off + count;
+    size_t start;
+
+    if (!file->ops->advise_fn || file->advice == FILE_ADV_RANDOM) {
+        return;
+    }
+
+    if (off != file->ra_next && file->advice != FILE_ADV_SEQUENTIAL) {
+        file->ra_next = end;
+        file->ra_end = end;
+        file->ra_window = 0;
+        return;
+    }
+
+    file->ra_next = end;
+
+    if (file->ra_end > end + file->ra_window / 2) {
+        return;
+    }
+
+    if (file->advice == FILE_ADV_SEQUENTIAL) {
+        file->ra_window = FILE_RA_MAX;
+    } else {
+        file->ra_window = file->ra_window ? file->ra_window * 2 : FILE_RA_MIN;
+        if (file->ra_window > FILE_RA_MAX) {
+            file->ra_window = FILE_RA_MAX;
+        }
+    }
+
+    start = (file->ra_end > end) ? file->ra_end : end;
+    file->ra_end = end + file->ra_window;
+
+    (void)file->ops->advise_fn(file, start, file->ra_end - start, FILE_ADV_WILLNEED);
+}
+
 /* read data to a memory buffer */
 ssize_t
 file_read(int fd, void *buf, size_t nbyte)
 {
     struct file *file;
+    size_t pos;
     ssize_t ret;
 
-    file = &files[fd];
+    if (!(file = file_hold(fd))) {
+        return -1;
+    }
+
+    pos = file->pos;
     ret = file->ops->read_fn(file, buf, nbyte);
-    
+
+    if (ret > 0) {
+        file_readahead(file, pos, ret);
+    }
+
+    (void)file_put(file);
+
     return ret;
 }
 
@@ -74,9 +339,321 @@ file_write(int fd, void *buf, size_t nbyte)
     struct file *file;
     ssize_t ret;
 
-    file = &files[fd];
+    if (!(file = file_hold(fd))) {
+        return -1;
+    }
+
     ret = file->ops->write_fn(file, buf, nbyte);
-    
+    (void)file_put(file);
+
+    return ret;
+}
+
+/* load information about an open file */
+int
+file_stat(int fd, struct file_info *info)
+{
+    struct file *file;
+    int ret;
+
+    if (!(file = file_hold(fd))) {
+        return -1;
+    }
+
+    ret = file->ops->stat_fn ? file->ops->stat_fn(file, info) : -1;
+    (void)file_put(file);
+
+    return ret;
+}
+
+/* set the position of a file. return the new position or -1 */
+ssize_t
+file_seek(int fd, ssize_t off, int whence)
+{
+    struct file *file;
+    struct file_info info;
+    ssize_t pos;
+
+    if (!(file = file_hold(fd))) {
+        return -1;
+    }
+
+    switch (whence) {
+    case SEEK_SET:
+        pos = off;
+        break;
+    case SEEK_CUR:
+        pos = file->pos + off;
+        break;
+    case SEEK_END:
+        if (!file->ops->stat_fn || file->ops->stat_fn(file, &info)) {
+            pos = -1;
+            break;
+        }
+        pos = info.size + off;
+        break;
+    default:
+        pos = -1;
+        break;
+    }
+
+    if (pos >= 0 && file->ops->seek_fn && file->ops->seek_fn(file, pos)) {
+        pos = -1;
+    }
+
+    if (pos >= 0) {
+        file->pos = pos;
+    }
+
+    (void)file_put(file);
+
+    return pos < 0 ? -1 : pos;
+}
+
+/*
+ * read data from a given offset to a memory buffer, without moving
+ * the file position. drivers without pread_fn get a plain read at the
+ * requested position
+ */
+ssize_t
+file_pread(int fd, void *buf, size_t nbyte, size_t off)
+{
+    struct file *file;
+    size_t pos;
+    ssize_t ret;
+
+    if (!(file = file_hold(fd))) {
+        return -1;
+    }
+
+    if (file->ops->pread_fn) {
+        ret = file->ops->pread_fn(file, buf, nbyte, off);
+    } else if (file->ops->seek_fn && file->ops->seek_fn(file, off)) {
+        ret = -1;
+    } else {
+        pos = file->pos;
+        file->pos = off;
+        ret = file->ops->read_fn(file, buf, nbyte);
+        file->pos = pos;
+    }
+
+    if (ret > 0) {
+        file_readahead(file, off, ret);
+    }
+
+    (void)file_put(file);
+
+    return ret;
+}
+
+/*
+ * write data from a memory buffer at a given offset, without moving
+ * the file position. drivers without pwrite_fn get a plain write at the
+ * requested position
+ */
+ssize_t
+file_pwrite(int fd, const void *buf, size_t nbyte, size_t off)
+{
+    struct file *file;
+    size_t pos;
+    ssize_t ret;
+
+    if (!(file = file_hold(fd))) {
+        return -1;
+    }
+
+    if (file->ops->pwrite_fn) {
+        ret = file->ops->pwrite_fn(file, buf, nbyte, off);
+    } else if (file->ops->seek_fn && file->ops->seek_fn(file, off)) {
+        ret = -1;
+    } else {
+        pos = file->pos;
+        file->pos = off;
+        ret = file->ops->write_fn(file, buf, nbyte);
+        file->pos = pos;
+    }
+
+    (void)file_put(file);
+
+    return ret;
+}
+
+/* write a whole buffer to a file. return amount of written bytes */
+static ssize_t
+file_write_all(struct file *file, const void *buf, size_t nbyte)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < nbyte) {
+        ret = file->ops->write_fn(file, (const uint8_t *)buf + done, nbyte - done);
+        if (ret <= 0) {
+            return done ? (ssize_t)done : ret;
+        }
+        done += ret;
+    }
+
+    return done;
+}
+
+/*
+ * move up to nbyte bytes from one file to another inside the kernel.
+ * data of files supporting map_fn goes straight to the write_fn of the
+ * destination, other files and ones whose data can't be mapped are copied
+ * through a small bounce buffer.
+ * return amount of moved bytes or -1 on error
+ */
+ssize_t
+file_splice(int fd_in, int fd_out, size_t nbyte)
+{
+    struct file *in, *out;
+    uint8_t buf[FILE_SPLICE_BUF];
+    const void *addr;
+    size_t done = 0;
+    ssize_t ret = 0, count;
+    int map;
+
+    if (!(in = file_hold(fd_in))) {
+        return -1;
+    }
+
+    if (!(out = file_hold(fd_out))) {
+        (void)file_put(in);
+        return -1;
+    }
+
+    map = in->ops->map_fn && in->ops->map_fn(in, &addr, 0) >= 0;
+
+    while (done < nbyte) {
+        if (map) {
+            count = in->ops->map_fn(in, &addr, nbyte - done);
+            if (count <= 0) {
+                ret = count;
+                break;
+            }
+            ret = file_write_all(out, addr, count);
+            if (ret > 0) {
+                in->pos += ret;
+            }
+        } else {
+            count = nbyte - done > sizeof(buf) ? sizeof(buf) : nbyte - done;
+            count = in->ops->read_fn(in, buf, count);
+            if (count <= 0) {
+                ret = count;
+                break;
+            }
+            ret = file_write_all(out, buf, count);
+        }
+
+        if (ret > 0) {
+            done += ret;
+        }
+
+        if (ret < count) {
+            break;
+        }
+    }
+
+    (void)file_put(out);
+    (void)file_put(in);
+
+    return (done || ret >= 0) ? (ssize_t)done : -1;
+}
+
+/*
+ * wait until any of the descriptors is ready for its requested events or
+ * the timeout in milliseconds passes. a negative timeout waits forever,
+ * zero doesn't wait at all. return amount of ready descriptors
+ */
+int
+file_poll(struct poll_fd *fds, size_t count, int timeout)
+{
+    uint64_t deadline = pit_get_msecs() + (timeout > 0 ? timeout : 0);
+    struct file *file;
+    uint64_t flags, now;
+    int ready, ev;
+
+    // interrupts stay disabled between the check and the wait, so no wakeup is lost
+    flags = cpu_get_flags();
+    cpu_cli();
+
+    while (1) {
+        ready = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            if (!(file = file_get(fds[i].fd))) {
+                ev = POLL_ERR;
+            } else if (file->ops->poll_fn) {
+                ev = file->ops->poll_fn(file);
+            } else {
+                ev = POLL_IN | POLL_OUT;
+            }
+
+            fds[i].revents = ev & (fds[i].events | POLL_HUP | POLL_ERR);
+            ready += !!fds[i].revents;
+        }
+
+        if (ready || !timeout) {
+            break;
+        }
+
+        if (timeout < 0) {
+            task_wait(&file_pollers);
+            continue;
+        }
+
+        if ((now = pit_get_msecs()) >= deadline) {
+            break;
+        }
+
+        task_wait_timeout(&file_pollers, deadline - now);
+    }
+
+    cpu_set_flags(flags);
+
+    return ready;
+}
+
+/* let tasks blocked in file_poll() check their descriptors again */
+void
+file_poll_wakeup(void)
+{
+    task_wakeup(&file_pollers);
+}
+
+/*
+ * give the driver a hint about future access to a file. the access
+ * pattern hints apply to the whole file, the others to a given range
+ */
+int
+file_advise(int fd, size_t off, size_t len, int advice)
+{
+    struct file *file;
+    int ret;
+
+    if (!(file = file_hold(fd))) {
+        return -1;
+    }
+
+    switch (advice) {
+    case FILE_ADV_NORMAL:
+    case FILE_ADV_SEQUENTIAL:
+    case FILE_ADV_RANDOM:
+        file->advice = advice;
+        file->ra_window = 0;
+        ret = 0;
+        break;
+    case FILE_ADV_WILLNEED:
+    case FILE_ADV_DONTNEED:
+        ret = file->ops->advise_fn ? file->ops->advise_fn(file, off, len, advice) : 0;
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+
+    (void)file_put(file);
+
     return ret;
 }
 
@@ -84,5 +661,5 @@ file_write(int fd, void *buf, size_t nbyte)
 void
 files_init(void)
 {
-    ARRAY_INIT(files);
+    ARRAY_POOL_INIT(files);
 }
@@ -34,6 +34,17 @@ enum {
     KBD_DATA_PORT = 0x60,
 };
 
+/* scancodes handled by the driver */
+enum {
+    KBD_SC_EXTENDED = 0xE0,         // prefix of the gray keys
+    KBD_SC_LSHIFT = 0x2A,
+    KBD_SC_RSHIFT = 0x36,
+    KBD_SC_ALT = 0x38,
+    KBD_SC_F1 = 0x3B,
+    KBD_SC_PGUP = 0x49,
+    KBD_SC_PGDN = 0x51,
+};
+
 /* keyboard buffer */
 static struct kbd_buf {
     uint16_t buf[16];
@@ -53,13 +64,33 @@ static void
 kbd_handler(uint8_t intno, struct intr_stack *intr_stack, struct regs *regs)
 {
     static uint8_t shift = 0;
+    static uint8_t extended = 0;
+    static uint8_t alt = 0;
     unsigned char *map;
     uint16_t key;
-    uint8_t code;
+    uint8_t code, ext;
 
     code = cpu_inb(KBD_DATA_PORT);
 
-    if (code == 0xb6 || code == 0xaa) {
+    if (code == KBD_SC_EXTENDED) {
+        extended = 1;
+        return;
+    }
+
+    ext = extended;
+    extended = 0;
+
+    // the keyboard may wrap gray keys in fake shift presses, ignore them
+    if (ext && ((code & 0x7F) == KBD_SC_LSHIFT || (code & 0x7F) == KBD_SC_RSHIFT)) {
+        return;
+    }
+
+    if ((code & 0x7F) == KBD_SC_ALT) {
+        alt = !(code & 0x80);
+        return;
+    }
+
+    if (code == (KBD_SC_RSHIFT | 0x80) || code == (KBD_SC_LSHIFT | 0x80)) {
         shift = 0; 
         return;
     }
@@ -68,16 +99,30 @@ kbd_handler(uint8_t intno, struct intr_stack *intr_stack, struct regs *regs)
         return;
     }
 
-    if (code == 0x36 || code == 0x2a) {
+    if (code == KBD_SC_RSHIFT || code == KBD_SC_LSHIFT) {
         shift = 1;
         return;
     }
 
+    // alt with function keys switches virtual consoles
+    if (alt && code >= KBD_SC_F1 && code < KBD_SC_F1 + VT_COUNT) {
+        vt_switch(code - KBD_SC_F1);
+        return;
+    }
+
+    // shift with page up/down browses the console history
+    if (ext && shift && (code == KBD_SC_PGUP || code == KBD_SC_PGDN)) {
+        vt_scrollback(code == KBD_SC_PGUP ? VT_ROWS / 2 : -VT_ROWS / 2);
+        return;
+    }
+
     map = shift ? kbd_map_shift : kbd_map_default;
 
     key = ((uint16_t)code << 8) | map[code];
 
-    (void)kbd_buf_append(key);
+    if (!kbd_buf_append(key)) {
+        file_poll_wakeup();
+    }
 }
 
 /*
@@ -134,6 +179,13 @@ kbd_read(uint16_t *key)
     return ret;
 }
 
+/* return amount of keys waiting in the buffer */
+int
+kbd_pending(void)
+{
+    return kbd_buf.count;
+}
+
 /* initialize the keyboard buffer and set the interrupt handler */
 void
 kbd_init(void)
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/klog.c - kernel log ring
+ *
+ * messages are stored in a ring of fixed size records. a writer reserves
+ * consecutive sequence numbers with one atomic add, fills the records and
+ * publishes each one by storing its sequence number in the record, so tasks
+ * and interrupt handlers append without locking. readers copy a record and
+ * check that it wasn't overwritten in the meantime. the klogd task drains
+ * the ring to the console and the serial port, /dev/kmsg reads it.
+ *
+ * printk checks the threshold of the subsystem of a message before
+ * formatting it. writing "name=level" pairs to /dev/kmsg changes them.
+ */
+
+#include <kernel/kernel.h>
+
+enum {
+    KLOG_RECS       = 512,          // records in the ring, power of two
+    KLOG_TEXT       = 104,          // bytes of text in a record
+    KLOG_BACKLOG    = 256,          // drain by the writer if more are pending
+};
+
+/* record flags */
+enum {
+    KLOG_CONT       = 0x01,         // continues the text of the previous record
+};
+
+/* log record, state is 2 * seq + 1 while it's written and 2 * seq + 2 after */
+struct klog_rec {
+    uint64_t state;
+    uint64_t msecs;
+    uint8_t level;
+    uint8_t flags;
+    uint16_t len;
+    char text[KLOG_TEXT];
+};
+
+/* private functions */
+static int klog_get(uint64_t seq, struct klog_rec *rec);
+static void klog_emit(struct klog_rec *rec);
+static void klog_drain(void);
+static void klogd(int argc, char **argv);
+static int klog_find_subsys(const char *name, size_t len);
+
+/* the ring, the next sequence number to reserve and to write to the sinks */
+static struct klog_rec klog_recs[KLOG_RECS];
+static uint64_t klog_head = 0;
+static uint64_t klog_sink_seq = 0;
+static uint8_t klog_draining = 0;
+static uint8_t klog_daemon = 0;
+
+/* printk thresholds of subsystems, debug messages are off by default */
+static uint8_t klog_levels[KLOG_SYS_COUNT] = {
+    [KLOG_SYS_KERNEL]   = KERN_INFO,
+    [KLOG_SYS_MEM]      = KERN_INFO,
+    [KLOG_SYS_BLK]      = KERN_INFO,
+    [KLOG_SYS_FS]       = KERN_INFO,
+};
+
+static const char *klog_subsys_names[KLOG_SYS_COUNT] = {
+    [KLOG_SYS_KERNEL]   = "kernel",
+    [KLOG_SYS_MEM]      = "mem",
+    [KLOG_SYS_BLK]      = "blk",
+    [KLOG_SYS_FS]       = "fs",
+};
+
+/*
+ * copy a record with the given sequence number. return 0 on success,
+ * -1 if it wasn't published yet and 1 if it was overwritten
+ */
+static int
+klog_get(uint64_t seq, struct klog_rec *rec)
+{
+    struct klog_rec *slot = &klog_recs[seq & (KLOG_RECS - 1)];
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+    if (state < 2 * seq + 2) {
+        return -1;
+    }
+
+    memcpy(rec, slot, sizeof(*rec));
+
+    // the copy is valid if no writer took the slot in the meantime
+    if (state != 2 * seq + 2 || __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != state) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* write a record to the console and the serial port */
+static void
+klog_emit(struct klog_rec *rec)
+{
+    const char *prefix = NULL;
+
+    if (!(rec->flags & KLOG_CONT)) {
+        switch (rec->level) {
+        case KERN_DEBUG: prefix = "debug: "; break;
+        case KERN_WARN: prefix = "warn: "; break;
+        case KERN_ERR: prefix = "err: "; break;
+        default: break;
+        }
+    }
+
+    if (prefix) {
+        vt_write(vt_active(), prefix, strlen(prefix));
+        uart_write(prefix, strlen(prefix));
+    }
+
+    vt_write(vt_active(), rec->text, rec->len);
+    uart_write(rec->text, rec->len);
+}
+
+/* write all published records to the sinks, records not published yet stop it */
+static void
+klog_drain(void)
+{
+    struct klog_rec rec;
+    uint64_t head;
+    int ret;
+
+    // an interrupted drain is finished by its owner
+    if (__atomic_exchange_n(&klog_draining, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    head = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+
+    // skip records overwritten before they were written out
+    if (head - klog_sink_seq > KLOG_RECS) {
+        klog_sink_seq = head - KLOG_RECS;
+    }
+
+    while (klog_sink_seq != head && (ret = klog_get(klog_sink_seq, &rec)) >= 0) {
+        if (!ret) {
+            klog_emit(&rec);
+        }
+        klog_sink_seq++;
+    }
+
+    __atomic_store_n(&klog_draining, 0, __ATOMIC_RELEASE);
+}
+
+/* drain the ring whenever there are new records */
+static void
+klogd(int argc, char **argv)
+{
+    uint64_t flags;
+
+    while (1) {
+        flags = cpu_get_flags();
+        cpu_cli();
+
+        while (klog_sink_seq == __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE)) {
+            task_wait(klog_recs);
+        }
+
+        cpu_set_flags(flags);
+
+        klog_drain();
+    }
+}
+
+/* return a subsystem with the given name, KLOG_SYS_COUNT for all, or -1 */
+static int
+klog_find_subsys(const char *name, size_t len)
+{
+    char tmp[NAME_MAX];
+
+    if (len >= sizeof(tmp)) {
+        return -1;
+    }
+
+    strncpy(tmp, name, len);
+    tmp[len] = '\0';
+
+    if (!strcmp(tmp, "all")) {
+        return KLOG_SYS_COUNT;
+    }
+
+    for (int sys = 0; sys < KLOG_SYS_COUNT; ++sys) {
+        if (!strcmp(tmp, klog_subsys_names[sys])) {
+            return sys;
+        }
+    }
+
+    return -1;
+}
+
+/* append a message to the log, split over as many records as it needs */
+void
+klog_write(int level, const char *text, size_t len)
+{
+    struct klog_rec *slot;
+    uint64_t seq, count;
+    uint64_t msecs = pit_get_msecs();
+
+    count = len ? (len + KLOG_TEXT - 1) / KLOG_TEXT : 1;
+    count = count < KLOG_RECS ? count : KLOG_RECS;
+    seq = __atomic_fetch_add(&klog_head, count, __ATOMIC_ACQ_REL);
+
+    for (uint64_t i = 0; i < count; ++i, ++seq) {
+        slot = &klog_recs[seq & (KLOG_RECS - 1)];
+
+        __atomic_store_n(&slot->state, 2 * seq + 1, __ATOMIC_RELEASE);
+
+        slot->msecs = msecs;
+        slot->level = level;
+        slot->flags = i ? KLOG_CONT : 0;
+        slot->len = len < KLOG_TEXT ? len : KLOG_TEXT;
+        memcpy(slot->text, text, slot->len);
+
+        text += slot->len;
+        len -= slot->len;
+
+        __atomic_store_n(&slot->state, 2 * seq + 2, __ATOMIC_RELEASE);
+    }
+
+    // tasks aren't preempted, so a writer which never blocks drains a backlog
+    if (!klog_daemon || seq - klog_sink_seq >= KLOG_BACKLOG) {
+        klog_drain();
+    } else {
+        task_wakeup(klog_recs);
+    }
+}
+
+/*
+ * read records starting at sequence number *seq, formatted as
+ * "level,seq,msecs;text". updates *seq and returns the amount of bytes read.
+ * a record larger than the whole buffer is cut, so readers always advance
+ */
+size_t
+klog_read(uint64_t *seq, char *buf, size_t nbyte)
+{
+    struct klog_rec rec;
+    uint64_t head = __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+    size_t count = 0;
+    int hlen, ret;
+    char hdr[48];
+
+    if (head - *seq > KLOG_RECS) {
+        *seq = head - KLOG_RECS;
+    }
+
+    while (*seq != head && (ret = klog_get(*seq, &rec)) >= 0) {
+        hlen = 0;
+        if (!ret && !(rec.flags & KLOG_CONT)) {
+            hlen = snprintf(hdr, sizeof(hdr), "%d,%u,%u;", rec.level,
+                            (unsigned)*seq, (unsigned)rec.msecs);
+        }
+
+        // only whole records are returned, unless not even the first one fits
+        if (!ret && count + hlen + rec.len > nbyte) {
+            if (count || !nbyte) {
+                break;
+            }
+
+            hlen = (size_t)hlen < nbyte ? hlen : (int)nbyte;
+            rec.len = nbyte - hlen < rec.len ? nbyte - hlen : rec.len;
+        }
+
+        if (!ret) {
+            memcpy(buf + count, hdr, hlen);
+            memcpy(buf + count + hlen, rec.text, rec.len);
+            count += hlen + rec.len;
+        }
+
+        (*seq)++;
+    }
+
+    return count;
+}
+
+/* write all records to the sinks now, for panics */
+void
+klog_sync(void)
+{
+    __atomic_store_n(&klog_draining, 0, __ATOMIC_RELEASE);
+    klog_drain();
+}
+
+/* check if printk of a subsystem passes messages of the given level */
+int
+klog_enabled(int sys, int level)
+{
+    return level >= klog_levels[sys];
+}
+
+/* set the printk threshold of a subsystem. return 0 on success or -1 */
+int
+klog_set_level(int sys, int level)
+{
+    if (sys < 0 || sys >= KLOG_SYS_COUNT || level < KERN_DEBUG || level > KERN_ERR) {
+        return -1;
+    }
+
+    klog_levels[sys] = level;
+
+    return 0;
+}
+
+/*
+ * set thresholds from "name=level" pairs separated by spaces, commas or
+ * newlines, name "all" sets every subsystem. return nbyte or -1 on errors
+ */
+ssize_t
+klog_configure(const char *buf, size_t nbyte)
+{
+    size_t pos = 0, name;
+    int sys;
+
+    while (pos < nbyte) {
+        if (buf[pos] == ' ' || buf[pos] == ',' || buf[pos] == '\n') {
+            pos++;
+            continue;
+        }
+
+        name = pos;
+        while (pos < nbyte && buf[pos] != '=') {
+            pos++;
+        }
+
+        // a pair is a name, '=' and a single digit level
+        if (pos + 1 >= nbyte || (sys = klog_find_subsys(buf + name, pos - name)) < 0) {
+            return -1;
+        }
+
+        pos++;
+
+        for (int i = 0; i < KLOG_SYS_COUNT; ++i) {
+            if ((sys == KLOG_SYS_COUNT || sys == i) && klog_set_level(i, buf[pos] - '0')) {
+                return -1;
+            }
+        }
+
+        pos++;
+    }
+
+    return nbyte;
+}
+
+/* start draining the log from a separate task */
+void
+klog_init(void)
+{
+    kassert(task_spawn((uintptr_t)klogd, 0, NULL) >= 0, "cannot start klogd");
+    klog_daemon = 1;
+}
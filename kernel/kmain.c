@@ -47,21 +47,39 @@ kmain(uintptr_t mboot_paddr)
 
     // initialize interrupt handlers
     intr_init();
+    uart_intr_init();
 
     // initialize timer, multi-tasking and system calls
     pit_init();
     tasks_init();
+    vt_flush_init();
+    klog_init();
 
     // initialize keyboard driver
     kbd_init();
 
+    // initialize block devices
+    blk_init();
+    ata_init();
+    virtio_blk_init();
+
     // initialize virtual filesystem switch and mount basic filesystems
     files_init();
     vfs_init();
     (void)devfs_mount("/dev");
+    (void)pipefs_mount("/pipe");
+    (void)tmpfs_mount("/tmp");
     (void)romfs_mount((uintptr_t)mboot_mod(0), "/data");
     (void)romfs_mount((uintptr_t)mboot_mod(1), "/apps");
 
+    // the boot disk, through virtio if available
+    if (ext2_mount("vda", "/disk")) {
+        (void)ext2_mount("hda", "/disk");
+    }
+
+    // initialize asynchronous i/o rings, their workers start with them
+    aio_init();
+
     // initialize GUI features
     if (vbe_gfx_mode()) {
         win_init();
@@ -71,8 +89,15 @@ kmain(uintptr_t mboot_paddr)
         bar_init();
     }
 
-    // execute nf interpreter
-    task_spawn_name("nf", 0, 0);
+    printk(KERN_INFO, "boot completed in %u ms, %u KiB heap, %u KiB free\n",
+           (unsigned)pit_get_msecs(), (unsigned)(kheap_used() >> 10),
+           (unsigned)(pmem_avail() >> 10));
+
+    // execute nf interpreter on each virtual console
+    for (int con = 0; con < VT_COUNT; ++con) {
+        task_set_vt(con);
+        task_spawn_name("nf", 0, 0);
+    }
 
     // terminate curren task
     task_exit(0);
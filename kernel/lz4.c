@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/lz4.c - LZ4 block decompression
+ */
+
+#include <kernel/kernel.h>
+
+/* read an extended length field. return -1 on truncated input */
+static ssize_t
+lz4_length(const uint8_t **ip, const uint8_t *iend, size_t len)
+{
+    uint8_t b;
+
+    if (len != 15) {
+        return len;
+    }
+
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+
+    return len;
+}
+
+/*
+ * decompress a single LZ4 block into a buffer of a given size.
+ * return amount of decompressed bytes or -1 on malformed input
+ */
+ssize_t
+lz4_decompress(const void *src, size_t srclen, void *dst, size_t dstlen)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + srclen;
+    const uint8_t *match;
+    uint8_t *op = dst;
+    uint8_t *oend = op + dstlen;
+    size_t offset;
+    ssize_t len;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        // copy literals
+        len = lz4_length(&ip, iend, token >> 4);
+        if (len < 0 || len > iend - ip || len > oend - op) {
+            return -1;
+        }
+
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        // the last sequence has no match
+        if (ip >= iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (!offset || offset > (size_t)(op - (uint8_t *)dst)) {
+            return -1;
+        }
+
+        // copy match, byte by byte if it overlaps the output
+        len = lz4_length(&ip, iend, token & 0x0F);
+        if (len < 0 || len + 4 > oend - op) {
+            return -1;
+        }
+
+        len += 4;
+        match = op - offset;
+
+        if (offset >= (size_t)len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            while (len--) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return op - (uint8_t *)dst;
+}
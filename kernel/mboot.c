@@ -7,6 +7,8 @@
  * kernel/mboot.c - multiboot structures and routines
  */
 
+#define KLOG_SUBSYS KLOG_SYS_MEM
+
 #include <kernel/kernel.h>
 
 /* multiboot flags */
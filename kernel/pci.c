@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/pci.c - PCI configuration space access
+ */
+
+#include <kernel/kernel.h>
+
+/* i/o ports and configuration registers */
+enum {
+    PCI_CONFIG_ADDR     = 0xCF8,
+    PCI_CONFIG_DATA     = 0xCFC,
+
+    PCI_REG_ID          = 0x00,
+    PCI_REG_COMMAND     = 0x04,
+    PCI_REG_HEADER      = 0x0C,
+    PCI_REG_BAR0        = 0x10,
+    PCI_REG_IRQ         = 0x3C,
+
+    PCI_CMD_IO          = 0x01,
+    PCI_CMD_MEM         = 0x02,
+    PCI_CMD_MASTER      = 0x04,
+    PCI_HEADER_MULTI    = 0x800000,
+};
+
+/* private functions */
+static uint32_t pci_addr(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off);
+static uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off);
+static void pci_load(struct pci_dev *pdev, uint8_t bus, uint8_t slot, uint8_t func);
+
+/* return a configuration address of a register, with the enable bit set */
+static uint32_t
+pci_addr(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off)
+{
+    return 0x80000000u | (bus << 16) | (slot << 11) | (func << 8) | (off & 0xFC);
+}
+
+/* read a double word from the configuration space of a given function */
+static uint32_t
+pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off)
+{
+    cpu_outl(PCI_CONFIG_ADDR, pci_addr(bus, slot, func, off));
+
+    return cpu_inl(PCI_CONFIG_DATA);
+}
+
+/* load location and basic configuration of a given function */
+static void
+pci_load(struct pci_dev *pdev, uint8_t bus, uint8_t slot, uint8_t func)
+{
+    uint32_t id = pci_config_read(bus, slot, func, PCI_REG_ID);
+
+    pdev->bus = bus;
+    pdev->slot = slot;
+    pdev->func = func;
+    pdev->vendor = id & 0xFFFF;
+    pdev->device = id >> 16;
+    pdev->irq = pci_config_read(bus, slot, func, PCI_REG_IRQ) & 0xFF;
+
+    for (int i = 0; i < 6; ++i) {
+        pdev->bar[i] = pci_config_read(bus, slot, func, PCI_REG_BAR0 + i * 4);
+    }
+}
+
+/* read a double word from the configuration space of a device */
+uint32_t
+pci_read(struct pci_dev *pdev, uint8_t off)
+{
+    return pci_config_read(pdev->bus, pdev->slot, pdev->func, off);
+}
+
+/* write a double word to the configuration space of a device */
+void
+pci_write(struct pci_dev *pdev, uint8_t off, uint32_t val)
+{
+    cpu_outl(PCI_CONFIG_ADDR, pci_addr(pdev->bus, pdev->slot, pdev->func, off));
+    cpu_outl(PCI_CONFIG_DATA, val);
+}
+
+/* find the first device with given ids. return 0 on success */
+int
+pci_find(uint16_t vendor, uint16_t device, struct pci_dev *dest)
+{
+    uint32_t id;
+    int funcs;
+
+    for (int bus = 0; bus < 256; ++bus) {
+        for (int slot = 0; slot < 32; ++slot) {
+
+            // skip empty slots and functions of single-function devices
+            if ((pci_config_read(bus, slot, 0, PCI_REG_ID) & 0xFFFF) == 0xFFFF) {
+                continue;
+            }
+
+            funcs = (pci_config_read(bus, slot, 0, PCI_REG_HEADER) & PCI_HEADER_MULTI) ? 8 : 1;
+
+            for (int func = 0; func < funcs; ++func) {
+                id = pci_config_read(bus, slot, func, PCI_REG_ID);
+
+                if ((id & 0xFFFF) == vendor && (id >> 16) == device) {
+                    pci_load(dest, bus, slot, func);
+                    return 0;
+                }
+            }
+        }
+    }
+
+    return -1;
+}
+
+/* enable i/o and memory decoding and bus mastering of a device */
+void
+pci_enable(struct pci_dev *pdev)
+{
+    uint32_t cmd = pci_read(pdev, PCI_REG_COMMAND);
+
+    pci_write(pdev, PCI_REG_COMMAND, cmd | PCI_CMD_IO | PCI_CMD_MEM | PCI_CMD_MASTER);
+}
@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/pipefs.c - named pipes between tasks
+ *
+ * opening a missing name with VFS_CREATE creates a pipe, which lives
+ * until all files referring to it are closed. data goes through a ring
+ * buffer with a single producer and a single consumer, each of them
+ * updating only its own index, so no locking nor disabling interrupts
+ * is needed. readers of an empty pipe and writers to a full one are
+ * blocked on the scheduler until the other side makes progress, the
+ * first write also waits until the pipe is opened by another file.
+ * every change of state also wakes up tasks polling for files.
+ */
+
+#define KLOG_SUBSYS KLOG_SYS_FS
+
+#include <kernel/kernel.h>
+
+enum {
+    PIPE_COUNT      = 8,            // max number of pipes
+    PIPE_SIZE       = 4096,         // size of the ring buffer, power of two
+};
+
+/* pipe object, inode handle of a pipe is its index plus one */
+struct pipe {
+    uint8_t active;
+    array_index_t next_free;
+    array_index_t next_hash;
+    char name[NAME_MAX];
+
+    uint32_t refs;                  // amount of open file objects
+    uint8_t peered;                 // set once the pipe had two files open
+
+    size_t head;                    // total bytes written, owned by the writer
+    size_t tail;                    // total bytes read, owned by the reader
+    uint8_t *buf;
+};
+
+/* private functions */
+static struct pipe *pipefs_get(uintptr_t inh);
+static void pipefs_put(struct pipe *pipe);
+static int pipefs_eof(struct pipe *pipe);
+static void pipefs_wakeup(struct pipe *pipe);
+static void pipefs_load_file_info(struct file_info *info, uintptr_t inh);
+static int pipefs_lookup(uintptr_t sbh, uintptr_t inh, const char *name,
+                         struct file_info *dest);
+static int pipefs_create(uintptr_t sbh, uintptr_t inh, const char *name,
+                         int type, struct file_info *dest);
+static int pipefs_open(uintptr_t sbh, uintptr_t inh);
+static int pipefs_close(struct file *file);
+static ssize_t pipefs_read_dir(struct file *file, void *buf, size_t nbyte);
+static ssize_t pipefs_read_pipe(struct pipe *pipe, void *buf, size_t nbyte);
+static ssize_t pipefs_read(struct file *file, void *buf, size_t nbyte);
+static ssize_t pipefs_write(struct file *file, const void *buf, size_t nbyte);
+static int pipefs_stat(struct file *file, struct file_info *info);
+static int pipefs_seek(struct file *file, size_t pos);
+static int pipefs_poll(struct file *file);
+
+/* file operations */
+static struct file_ops pipefs_file_ops = {
+    .close_fn = &pipefs_close,
+    .read_fn = &pipefs_read,
+    .write_fn = &pipefs_write,
+    .stat_fn = &pipefs_stat,
+    .seek_fn = &pipefs_seek,
+    .poll_fn = &pipefs_poll,
+};
+
+/* vfs operations */
+static struct vfs_ops pipefs_ops = {
+    .open_fn = &pipefs_open,
+    .lookup_fn = &pipefs_lookup,
+    .create_fn = &pipefs_create,
+};
+
+/* array of pipes */
+static struct pipe pipes[PIPE_COUNT];
+static ARRAY_POOL_HEAD(pipes);
+static ARRAY_HASH_HEAD(pipes, PIPE_COUNT);
+
+/* return a pipe with a given inode handle or NULL for the root directory */
+static struct pipe *
+pipefs_get(uintptr_t inh)
+{
+    if (!inh || inh > PIPE_COUNT || !pipes[inh - 1].active) {
+        return NULL;
+    }
+
+    return &pipes[inh - 1];
+}
+
+/* drop a reference to a pipe, remove it when it's not open anymore */
+static void
+pipefs_put(struct pipe *pipe)
+{
+    if (pipe->refs && --pipe->refs) {
+        return;
+    }
+
+    // the buffer stays with the slot, kernel heap can't free memory
+    ARRAY_HASH_REMOVE(pipes, pipe, name);
+    ARRAY_POOL_RELEASE(pipes, pipe);
+}
+
+/* check if the other end of a pipe has been closed */
+static int
+pipefs_eof(struct pipe *pipe)
+{
+    return pipe->peered && pipe->refs < 2;
+}
+
+/* wake up tasks blocked on a pipe and tasks polling for files */
+static void
+pipefs_wakeup(struct pipe *pipe)
+{
+    task_wakeup(pipe);
+    file_poll_wakeup();
+}
+
+/* load a file info structure for a specified node */
+static void
+pipefs_load_file_info(struct file_info *info, uintptr_t inh)
+{
+    struct pipe *pipe = pipefs_get(inh);
+
+    memset(info, 0, sizeof(*info));
+
+    info->inh = inh;
+    info->type = FT_DIR;
+
+    if (pipe) {
+        info->type = FT_REG;
+        info->size = pipe->head - pipe->tail;
+        strncpy(info->name, pipe->name, NAME_MAX);
+    }
+}
+
+/* find an existing pipe */
+static int
+pipefs_lookup(uintptr_t sbh, uintptr_t inh, const char *name,
+              struct file_info *dest)
+{
+    struct pipe *pipe;
+    array_index_t i;
+
+    if (inh || !(pipe = ARRAY_HASH_FIND_BY(pipes, name, name, &i))) {
+        return -1;
+    }
+
+    pipefs_load_file_info(dest, i + 1);
+
+    return 0;
+}
+
+/* create a new pipe in the root directory */
+static int
+pipefs_create(uintptr_t sbh, uintptr_t inh, const char *name,
+              int type, struct file_info *dest)
+{
+    struct pipe *pipe;
+
+    if (inh || type != FT_REG || strlen(name) >= NAME_MAX) {
+        return -1;
+    }
+
+    if (!(pipe = ARRAY_POOL_TAKE(pipes))) {
+        printk(KERN_WARN, "too many pipes\n");
+        return -1;
+    }
+
+    if (!pipe->buf && !(pipe->buf = kheap_alloc(PIPE_SIZE))) {
+        ARRAY_POOL_RELEASE(pipes, pipe);
+        return -1;
+    }
+
+    strncpy(pipe->name, name, NAME_MAX);
+    pipe->refs = 0;
+    pipe->peered = 0;
+    pipe->head = 0;
+    pipe->tail = 0;
+    ARRAY_HASH_INSERT(pipes, pipe, name);
+
+    pipefs_load_file_info(dest, pipe - pipes + 1);
+
+    return 0;
+}
+
+/* initialize a file object for the root directory or a pipe */
+static int
+pipefs_open(uintptr_t sbh, uintptr_t inh)
+{
+    struct pipe *pipe = pipefs_get(inh);
+    int fd;
+
+    if (inh && !pipe) {
+        return -1;
+    }
+
+    if (pipe && ++pipe->refs > 1) {
+        pipe->peered = 1;
+        pipefs_wakeup(pipe);
+    }
+
+    fd = file_new(sbh, inh, &pipefs_file_ops);
+
+    if (fd < 0 && pipe) {
+        pipefs_put(pipe);
+    }
+
+    return fd;
+}
+
+/* close a file, wake up the other end of a pipe so it can see the eof */
+static int
+pipefs_close(struct file *file)
+{
+    struct pipe *pipe = pipefs_get(file->inh);
+
+    if (pipe) {
+        pipefs_put(pipe);
+        pipefs_wakeup(pipe);
+    }
+
+    file_release(file);
+
+    return 0;
+}
+
+/* read as many directory entries as fit in a buffer */
+static ssize_t
+pipefs_read_dir(struct file *file, void *buf, size_t nbyte)
+{
+    struct file_info info;
+    size_t count = 0;
+
+    for (; file->pos < PIPE_COUNT; ++file->pos) {
+        if (!pipes[file->pos].active) {
+            continue;
+        }
+
+        if (nbyte - count < sizeof(info)) {
+            break;
+        }
+
+        pipefs_load_file_info(&info, file->pos + 1);
+        memcpy((uint8_t *)buf + count, &info, sizeof(info));
+        count += sizeof(info);
+    }
+
+    return count;
+}
+
+/* read available data, block while the pipe is empty. return 0 on eof */
+static ssize_t
+pipefs_read_pipe(struct pipe *pipe, void *buf, size_t nbyte)
+{
+    size_t head, tail, len, ofs;
+
+    tail = pipe->tail;
+
+    while ((head = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE)) == tail) {
+        if (pipefs_eof(pipe)) {
+            return 0;
+        }
+        task_wait(pipe);
+    }
+
+    if (nbyte > head - tail) {
+        nbyte = head - tail;
+    }
+
+    ofs = tail & (PIPE_SIZE - 1);
+    len = (nbyte < PIPE_SIZE - ofs) ? nbyte : PIPE_SIZE - ofs;
+
+    // the data may wrap around the end of the buffer
+    memcpy(buf, pipe->buf + ofs, len);
+    memcpy((uint8_t *)buf + len, pipe->buf, nbyte - len);
+
+    __atomic_store_n(&pipe->tail, tail + nbyte, __ATOMIC_RELEASE);
+    pipefs_wakeup(pipe);
+
+    return nbyte;
+}
+
+/* read data to a memory buffer */
+static ssize_t
+pipefs_read(struct file *file, void *buf, size_t nbyte)
+{
+    struct pipe *pipe = pipefs_get(file->inh);
+
+    if (!pipe) {
+        return pipefs_read_dir(file, buf, nbyte);
+    }
+
+    if (!nbyte) {
+        return 0;
+    }
+
+    return pipefs_read_pipe(pipe, buf, nbyte);
+}
+
+/*
+ * write all data to a pipe, block while it's full. return amount of
+ * bytes written before the reader went away, or -1 if none were
+ */
+static ssize_t
+pipefs_write(struct file *file, const void *buf, size_t nbyte)
+{
+    struct pipe *pipe = pipefs_get(file->inh);
+    size_t head, tail, len, ofs, n;
+    size_t done = 0;
+
+    if (!pipe) {
+        return -1;
+    }
+
+    // like a fifo, don't let the data out until someone opens the other end
+    while (!pipe->peered && nbyte) {
+        task_wait(pipe);
+    }
+
+    head = pipe->head;
+
+    while (done < nbyte) {
+        tail = __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+
+        if (pipefs_eof(pipe)) {
+            break;
+        }
+
+        if (head - tail == PIPE_SIZE) {
+            task_wait(pipe);
+            continue;
+        }
+
+        n = PIPE_SIZE - (head - tail);
+        if (n > nbyte - done) {
+            n = nbyte - done;
+        }
+
+        ofs = head & (PIPE_SIZE - 1);
+        len = (n < PIPE_SIZE - ofs) ? n : PIPE_SIZE - ofs;
+
+        memcpy(pipe->buf + ofs, (uint8_t *)buf + done, len);
+        memcpy(pipe->buf, (uint8_t *)buf + done + len, n - len);
+
+        head += n;
+        done += n;
+
+        __atomic_store_n(&pipe->head, head, __ATOMIC_RELEASE);
+        pipefs_wakeup(pipe);
+    }
+
+    return done || !nbyte ? (ssize_t)done : -1;
+}
+
+/* load a file info structure of an open file */
+static int
+pipefs_stat(struct file *file, struct file_info *info)
+{
+    pipefs_load_file_info(info, file->inh);
+    return 0;
+}
+
+/* validate a new position, only the directory can be rewound */
+static int
+pipefs_seek(struct file *file, size_t pos)
+{
+    return file->inh || pos ? -1 : 0;
+}
+
+/*
+ * return events a pipe is ready for. both ends share the file, so it's
+ * readable with data buffered and writable with free room once peered
+ */
+static int
+pipefs_poll(struct file *file)
+{
+    struct pipe *pipe = pipefs_get(file->inh);
+    size_t used;
+    int ev = 0;
+
+    if (!pipe) {
+        return POLL_IN;
+    }
+
+    used = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+
+    if (used) {
+        ev |= POLL_IN;
+    }
+
+    if (pipe->peered && used < PIPE_SIZE) {
+        ev |= POLL_OUT;
+    }
+
+    if (pipefs_eof(pipe)) {
+        ev |= POLL_HUP | POLL_IN;
+    }
+
+    return ev;
+}
+
+/* mount a pipe filesystem */
+int
+pipefs_mount(const char *volume)
+{
+    ARRAY_POOL_INIT(pipes);
+    ARRAY_HASH_INIT(pipes);
+
+    return vfs_mount(volume, &pipefs_ops, 0);
+}
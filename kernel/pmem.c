@@ -7,6 +7,8 @@
  * kernel/pmem.c - physical memory manager
  */
 
+#define KLOG_SUBSYS KLOG_SYS_MEM
+
 #include <kernel/kernel.h>
 
 /* frame status */
@@ -176,6 +178,19 @@ pmem_total(void)
     return pmem_total_p;
 }
 
+/* return amount of memory in frames not allocated yet */
+size_t
+pmem_avail(void)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < MEM_FRAME_COUNT; ++i) {
+        count += pmem_frames[i] == PMEM_FRAME_AVAIL;
+    }
+
+    return count * MEM_PAGE_SIZE;
+}
+
 /* initialize physical memory map */
 void
 pmem_init(void)
@@ -9,20 +9,12 @@
 
 #include <kernel/kernel.h>
 
-/* print a formatted string to uart and vt */
+/* format a message and append it to the kernel log */
 int
 vprintk(int level, const char *fmt, va_list args)
 {
+    char buf[KLOG_LINE_MAX];
     int count;
-    static char buf[4096];
-
-    switch (level) {
-    case KERN_DEBUG: printk(0, "debug: "); break;
-    case KERN_WARN: printk(0, "warn: "); break;
-    case KERN_ERR: printk(0, "err: "); break;
-    case KERN_INFO: break;
-    default: break;
-    }
 
     count = vsnprintf(buf, sizeof(buf), fmt, args);
 
@@ -30,15 +22,16 @@ vprintk(int level, const char *fmt, va_list args)
         return count;
     }
 
-    vt_write(buf, count);
-    uart_write(buf, count);
+    // longer messages are cut
+    count = count < (int)sizeof(buf) ? count : (int)sizeof(buf) - 1;
+    klog_write(level, buf, count);
 
     return count;
 }
 
-/* print a formatted string to uart and vt */
+/* format a message and append it to the kernel log, printk filters first */
 int
-printk(int level, const char *fmt, ...)
+kprintf(int level, const char *fmt, ...)
 {
     int ret;
     va_list args;
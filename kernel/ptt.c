@@ -7,6 +7,8 @@
  * kernel/ptt.c - page table manager
  */
 
+#define KLOG_SUBSYS KLOG_SYS_MEM
+
 #include <kernel/kernel.h>
 
 /* amount of entries in a single page table */
@@ -86,6 +88,20 @@ ptt_unmap(uint64_t vaddr)
     ptt_map(vaddr, 0, 0, 0);
 }
 
+/* translate a mapped virtual address to a physical address */
+uint64_t
+ptt_paddr(uint64_t vaddr)
+{
+    uint16_t pml4_offs = (vaddr & 0xFF8000000000) >> 39;
+    uint16_t pdpt_offs = (vaddr & 0x007FC0000000) >> 30;
+    uint16_t pd_offs =   (vaddr & 0x00003FE00000) >> 21;
+
+    union ptt_entry *ptt_pdpt = (union ptt_entry*)(uintptr_t)(ptt_pml4[pml4_offs].addr << 12);
+    union ptt_entry *ptt_pd =   (union ptt_entry*)(uintptr_t)(ptt_pdpt[pdpt_offs].addr << 12);
+
+    return (ptt_pd[pd_offs].addr << 12) + (vaddr & 0x1FFFFF);
+}
+
 /* initialize the page table manager */
 void
 ptt_init(void)
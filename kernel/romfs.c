@@ -7,6 +7,8 @@
  * kernel/romfs.c - basic romfs driver
  */
 
+#define KLOG_SUBSYS KLOG_SYS_FS
+
 #include <kernel/kernel.h>
 
 /* inode types */
@@ -15,6 +17,20 @@ enum {
     IN_REG = 0x02,
 };
 
+/* directory hash table, stored as data of directory headers by mkromfs */
+enum {
+    HTAB_MAGIC  = 0x52485431,   // 'RHT1'
+    HTAB_HDR    = 12,           // magic, bucket count, entry count
+};
+
+/* compressed files, marked by mkromfs with the magic in spec.info */
+enum {
+    ZFILE_MAGIC     = 0x524c5a34,   // 'RLZ4'
+    ZFILE_HDR       = 12,           // block size, file size, block count
+    ZBLOCK_MAX      = 0x8000,       // max supported block size
+    ZCACHE_COUNT    = 4,            // amount of cached blocks
+};
+
 /* superblock structure */
 struct romfs_sb {
     uintptr_t addr;
@@ -35,6 +51,24 @@ struct romfs_inode {
     uintptr_t data;
 };
 
+/* compressed file header */
+struct romfs_zfile {
+    uint32_t bsize;
+    uint32_t size;
+    uint32_t count;
+    uint32_t *offsets;
+};
+
+/* decompressed block of a compressed file */
+struct romfs_zblock {
+    uint8_t active;
+    uintptr_t inh;
+    uint32_t index;
+    uint32_t len;
+    uint64_t used;
+    uint8_t data[ZBLOCK_MAX];
+};
+
 /* private functions */
 static inline uintptr_t romfs_align_ptr(uintptr_t ptr);
 static inline uint32_t romfs_load_be32(uint32_t x);
@@ -44,25 +78,49 @@ static uintptr_t romfs_first_inode(uintptr_t sbh);
 static uintptr_t romfs_first_child_inode(uintptr_t sbh, uintptr_t inh);
 static uintptr_t romfs_next_inode(uintptr_t sbh, uintptr_t inh);
 static void romfs_load_file_info(struct file_info *info, uintptr_t inh);
+static size_t romfs_file_size(struct romfs_inode *inode);
+static int romfs_hash_find(uintptr_t sbh, struct romfs_inode *dir,
+                           const char *name, uintptr_t *dest);
+static int romfs_lookup(uintptr_t sbh, uintptr_t inh, const char *name,
+                        struct file_info *dest);
 static int romfs_open(uintptr_t sbh, uintptr_t inh);
 static int romfs_close(struct file *file);
+static int romfs_load_zfile(struct romfs_zfile *zf, struct romfs_inode *inode);
+static struct romfs_zblock *romfs_load_zblock(struct romfs_inode *inode,
+                                              struct romfs_zfile *zf,
+                                              uint32_t index);
+static ssize_t romfs_pread_zreg(struct romfs_inode *inode, void *buf,
+                                size_t nbyte, size_t off);
+static ssize_t romfs_pread(struct file *file, void *buf, size_t nbyte, size_t off);
 static ssize_t romfs_read_reg(struct file *file, void *buf, size_t nbyte);
 static ssize_t romfs_read_dir(struct file *file, void *buf, size_t nbyte);
 static ssize_t romfs_read(struct file *file, void *buf, size_t nbyte);
 static ssize_t romfs_write(struct file *file, const void *buf, size_t nbyte);
+static int romfs_stat(struct file *file, struct file_info *info);
+static int romfs_seek(struct file *file, size_t pos);
+static ssize_t romfs_map(struct file *file, const void **addr, size_t nbyte);
 
 /* file operations */
 static struct file_ops romfs_file_ops = {
     .close_fn = &romfs_close,
     .read_fn = &romfs_read,
     .write_fn = &romfs_write,
+    .stat_fn = &romfs_stat,
+    .seek_fn = &romfs_seek,
+    .pread_fn = &romfs_pread,
+    .map_fn = &romfs_map,
 };
 
 /* vfs operations */
 static struct vfs_ops romfs_ops = {
     .open_fn = &romfs_open,
+    .lookup_fn = &romfs_lookup,
 };
 
+/* cache of decompressed blocks, shared by all mounted filesystems */
+static struct romfs_zblock romfs_zcache[ZCACHE_COUNT];
+static uint64_t romfs_zcache_tick;
+
 /* align pointer to 16-bit boundary */
 static inline uintptr_t
 romfs_align_ptr(uintptr_t ptr)
@@ -176,6 +234,109 @@ romfs_load_file_info(struct file_info *info, uintptr_t inh)
     } else {
         info->type = FT_UNK;
     }
+
+    info->size = (info->type == FT_REG) ? romfs_file_size(&inode) : 0;
+}
+
+/* return the size of a regular file, as seen by readers */
+static size_t
+romfs_file_size(struct romfs_inode *inode)
+{
+    struct romfs_zfile zf;
+
+    if (inode->info != ZFILE_MAGIC) {
+        return inode->size;
+    }
+
+    return romfs_load_zfile(&zf, inode) ? 0 : zf.size;
+}
+
+/*
+ * find a directory entry using the hash table of the directory.
+ * return -1 if the directory has no hash table, otherwise 0 and set
+ * dest to the entry inode handle or to 0 if the name was not found.
+ */
+static int
+romfs_hash_find(uintptr_t sbh, struct romfs_inode *dir, const char *name,
+                uintptr_t *dest)
+{
+    uint32_t *tab = (uint32_t *)dir->data;
+    uint32_t *entries;
+    uint32_t nbuckets, count, bucket, first, last;
+    struct romfs_inode inode;
+
+    if (dir->size < HTAB_HDR || romfs_load_be32(tab[0]) != HTAB_MAGIC) {
+        return -1;
+    }
+
+    nbuckets = romfs_load_be32(tab[1]);
+    count = romfs_load_be32(tab[2]);
+
+    if (!nbuckets || (nbuckets & (nbuckets - 1)) ||
+        dir->size < HTAB_HDR + 4 * (nbuckets + 1 + count)) {
+        return -1;
+    }
+
+    bucket = strhash(name) & (nbuckets - 1);
+    first = romfs_load_be32(tab[3 + bucket]);
+    last = romfs_load_be32(tab[4 + bucket]);
+    entries = tab + 3 + nbuckets + 1;
+
+    *dest = 0;
+
+    for (uint32_t i = first; i < last && i < count; ++i) {
+        uintptr_t inh = sbh + romfs_load_be32(entries[i]);
+
+        romfs_load_inode(&inode, inh);
+
+        if (!strcmp(inode.name, name)) {
+            *dest = inh;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* find an entry with a given name in a specified directory */
+static int
+romfs_lookup(uintptr_t sbh, uintptr_t inh, const char *name,
+             struct file_info *dest)
+{
+    struct romfs_inode dir, inode;
+    uintptr_t child;
+
+    if (!inh) {
+        inh = romfs_first_inode(sbh);
+    }
+
+    romfs_load_inode(&dir, inh);
+
+    if (!(dir.flags & IN_DIR)) {
+        return -1;
+    }
+
+    // walk the chain of entries if there's no hash table, skip . and ..
+    if (romfs_hash_find(sbh, &dir, name, &child) < 0) {
+        child = romfs_first_child_inode(sbh, inh);
+        child = romfs_next_inode(sbh, child);
+
+        while (child) {
+            romfs_load_inode(&inode, child);
+            if (strcmp(inode.name, "..") && !strcmp(inode.name, name)) {
+                break;
+            }
+            child = romfs_next_inode(sbh, child);
+        }
+    }
+
+    if (!child) {
+        return -1;
+    }
+
+    romfs_load_file_info(dest, child);
+
+    return 0;
 }
 
 /* initialize a file object for a specified superblock and inode */
@@ -201,61 +362,205 @@ romfs_close(struct file *file)
     return 0;
 }
 
-/* read from a regular file to a buffer */
+/* load the header of a compressed file. return 0 on success */
+static int
+romfs_load_zfile(struct romfs_zfile *zf, struct romfs_inode *inode)
+{
+    uint32_t *hdr = (uint32_t *)inode->data;
+
+    if (inode->size < ZFILE_HDR) {
+        return -1;
+    }
+
+    zf->bsize = romfs_load_be32(hdr[0]);
+    zf->size = romfs_load_be32(hdr[1]);
+    zf->count = romfs_load_be32(hdr[2]);
+    zf->offsets = hdr + 3;
+
+    if (!zf->bsize || zf->bsize > ZBLOCK_MAX ||
+        zf->count != (zf->size + zf->bsize - 1) / zf->bsize ||
+        inode->size < ZFILE_HDR + 4 * (zf->count + 1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * return a decompressed block of a compressed file, decompressing it
+ * into the least recently used cache slot if needed. return NULL on error
+ */
+static struct romfs_zblock *
+romfs_load_zblock(struct romfs_inode *inode, struct romfs_zfile *zf,
+                  uint32_t index)
+{
+    struct romfs_zblock *zb = &romfs_zcache[0];
+    uint32_t start, end, len;
+    ssize_t ret;
+
+    ARRAY_FOREACH(romfs_zcache, i) {
+        if (romfs_zcache[i].active && romfs_zcache[i].inh == inode->addr &&
+            romfs_zcache[i].index == index) {
+            romfs_zcache[i].used = ++romfs_zcache_tick;
+            return &romfs_zcache[i];
+        }
+        if (!romfs_zcache[i].active || romfs_zcache[i].used < zb->used) {
+            zb = &romfs_zcache[i];
+        }
+    }
+
+    start = romfs_load_be32(zf->offsets[index]);
+    end = romfs_load_be32(zf->offsets[index + 1]);
+    len = (index == zf->count - 1) ? zf->size - index * zf->bsize : zf->bsize;
+
+    if (start > end || end > inode->size) {
+        return NULL;
+    }
+
+    zb->active = 0;
+
+    // blocks which didn't shrink are stored as is
+    if (end - start == len) {
+        memcpy(zb->data, (void *)(inode->data + start), len);
+    } else {
+        ret = lz4_decompress((void *)(inode->data + start), end - start,
+                             zb->data, len);
+        if (ret != len) {
+            printk(KERN_WARN, "romfs: corrupted block %u of %s\n",
+                   index, inode->name);
+            return NULL;
+        }
+    }
+
+    zb->active = 1;
+    zb->inh = inode->addr;
+    zb->index = index;
+    zb->len = len;
+    zb->used = ++romfs_zcache_tick;
+
+    return zb;
+}
+
+/* read from a given offset of a compressed regular file to a buffer */
 static ssize_t
-romfs_read_reg(struct file *file, void *buf, size_t nbyte)
+romfs_pread_zreg(struct romfs_inode *inode, void *buf, size_t nbyte, size_t off)
+{
+    struct romfs_zfile zf;
+    struct romfs_zblock *zb;
+    size_t ofs, count, done = 0;
+
+    if (romfs_load_zfile(&zf, inode)) {
+        return -1;
+    }
+
+    if (off >= zf.size) {
+        return 0;
+    }
+
+    if (off + nbyte > zf.size) {
+        nbyte = zf.size - off;
+    }
+
+    while (done < nbyte) {
+        zb = romfs_load_zblock(inode, &zf, (off + done) / zf.bsize);
+        if (!zb) {
+            return done ? (ssize_t)done : -1;
+        }
+
+        ofs = (off + done) % zf.bsize;
+        count = zb->len - ofs;
+        count = (count > nbyte - done) ? nbyte - done : count;
+
+        memcpy((uint8_t *)buf + done, zb->data + ofs, count);
+
+        done += count;
+    }
+
+    return done;
+}
+
+/* read from a given offset of a regular file to a buffer */
+static ssize_t
+romfs_pread(struct file *file, void *buf, size_t nbyte, size_t off)
 {
     struct romfs_inode inode;
 
     romfs_load_inode(&inode, file->inh);
 
-    if (file->pos + nbyte > inode.size) {
-        nbyte = inode.size - file->pos;
+    if (!(inode.flags & IN_REG) || (inode.flags & IN_DIR)) {
+        return -1;
+    }
+
+    if (inode.info == ZFILE_MAGIC) {
+        return romfs_pread_zreg(&inode, buf, nbyte, off);
     }
 
-    memcpy(buf, (void*)(inode.data + file->pos), nbyte);
+    if (off >= inode.size) {
+        return 0;
+    }
+
+    if (off + nbyte > inode.size) {
+        nbyte = inode.size - off;
+    }
 
-    file->pos += nbyte;
+    memcpy(buf, (void*)(inode.data + off), nbyte);
 
     return nbyte;
 }
 
-/* read a directory entry to a buffer */
+/* read from a regular file to a buffer */
+static ssize_t
+romfs_read_reg(struct file *file, void *buf, size_t nbyte)
+{
+    ssize_t ret = romfs_pread(file, buf, nbyte, file->pos);
+
+    if (ret > 0) {
+        file->pos += ret;
+    }
+
+    return ret;
+}
+
+/*
+ * read as many directory entries as fit in a buffer. the position
+ * is the inode handle of the last returned entry
+ */
 static ssize_t
 romfs_read_dir(struct file *file, void *buf, size_t nbyte)
 {
     uintptr_t inh;
     struct file_info info;
+    size_t count = 0;
 
-    if (nbyte < sizeof(struct file_info)) {
-        return 0;
-    }
+    while (nbyte - count >= sizeof(struct file_info)) {
+        if (file->pos) {
+            inh = file->pos;
+        } else if (file->inh) {
+            inh = romfs_first_child_inode(file->sbh, file->inh);
+        } else {
+            inh = romfs_first_inode(file->sbh);
+        }
 
-    if (file->pos) {
-        inh = file->pos;
-    } else if (file->inh) {
-        inh = romfs_first_child_inode(file->sbh, file->inh);
-    } else {
-        inh = romfs_first_inode(file->sbh);
-    }
+        inh = romfs_next_inode(file->sbh, inh);
 
-    inh = romfs_next_inode(file->sbh, inh);
+        if (!inh) {
+            break;
+        }
 
-    if (!inh) {
-        return 0;
-    }
+        file->pos = inh;
 
-    romfs_load_file_info(&info, inh);
-    memcpy(buf, &info, sizeof(info));
+        romfs_load_file_info(&info, inh);
 
-    file->pos = inh;
+        // skip .. entry
+        if (!strcmp(info.name, "..")) {
+            continue;
+        }
 
-    // skip .. entry
-    if (!strcmp(info.name, "..")) {
-        return romfs_read_dir(file, buf, nbyte);
+        memcpy((uint8_t *)buf + count, &info, sizeof(info));
+        count += sizeof(info);
     }
 
-    return sizeof(struct file_info);
+    return count;
 }
 
 /* read data from a file to a buffer */
@@ -279,6 +584,53 @@ romfs_write(struct file *file, const void *buf, size_t nbyte)
     return -1;
 }
 
+/* load a file info structure of an open file */
+static int
+romfs_stat(struct file *file, struct file_info *info)
+{
+    romfs_load_file_info(info, file->inh);
+    return 0;
+}
+
+/* validate a new position. directories can only be rewound */
+static int
+romfs_seek(struct file *file, size_t pos)
+{
+    struct file_info info;
+
+    romfs_load_file_info(&info, file->inh);
+
+    switch (info.type) {
+    case FT_REG: return 0;
+    case FT_DIR: return pos ? -1 : 0;
+    default: return -1;
+    }
+}
+
+/*
+ * map data at the current position of a regular file, in place. compressed
+ * data isn't mapped, a cached block may be evicted while the mapping is used
+ */
+static ssize_t
+romfs_map(struct file *file, const void **addr, size_t nbyte)
+{
+    struct romfs_inode inode;
+
+    romfs_load_inode(&inode, file->inh);
+
+    if (!(inode.flags & IN_REG) || (inode.flags & IN_DIR) || inode.info == ZFILE_MAGIC) {
+        return -1;
+    }
+
+    if (file->pos >= inode.size) {
+        return 0;
+    }
+
+    *addr = (void *)(inode.data + file->pos);
+
+    return (inode.size - file->pos < nbyte) ? inode.size - file->pos : nbyte;
+}
+
 /* mount a rom filesystem */
 int
 romfs_mount(uintptr_t addr, const char *volume)
@@ -8,7 +8,7 @@
 #include <kernel/kernel.h>
 
 enum {
-    TASK_COUNT      = 8,            // max number of tasks
+    TASK_COUNT      = 16,           // max number of tasks
     TASK_STACK_SIZE = 32768,        // size of task stack
     TASK_RFLAGS     = (0x01 << 9),  // initial RFLAGS (interrupts enabled)
 };
@@ -16,9 +16,11 @@ enum {
 /* structure representing the entire state of a task */
 struct task {
     uint8_t active;
+    array_index_t next_free;
 
     task_pid_t pid;
     task_pid_t waits_for;
+    const void *wait_chan;
 
     uint8_t exit_req;
     uint8_t exit_code;
@@ -28,6 +30,11 @@ struct task {
     uint64_t rflags;
     uint64_t rsp;
     struct regs regs;
+
+    struct fdtable fdt;
+    struct fdtable *fdt_borrowed;   // table of another task a worker acts for
+
+    uint8_t vt;                     // virtual console of the task
 };
 
 /* private methods */
@@ -41,6 +48,7 @@ static void task_intr_handle(uint8_t intno, struct intr_stack *intr_stack, struc
 static uint64_t task_next_pid = 0;
 static struct task *task_current;
 static struct task tasks[TASK_COUNT];
+static ARRAY_POOL_HEAD(tasks);
 typedef uint8_t stack_t[TASK_STACK_SIZE];
 static stack_t stacks[TASK_COUNT];
 
@@ -76,7 +84,7 @@ task_do_exit(struct task *task)
             tasks[i].regs.rax = task->exit_code;
         }
     }
-    ARRAY_RELEASE(task);
+    ARRAY_POOL_RELEASE(tasks, task);
 }
 
 /* return task which should be activated after the given one */
@@ -84,21 +92,35 @@ static struct task *
 task_next(struct task *task)
 {
     uint64_t now;
-    int idx;
+    int idx, start;
 
     now = pit_get_msecs();
-    idx = task - tasks;
+    idx = start = task - tasks;
 
     while (1) {
         idx = (idx + 1) % ARRAY_LENGTH(tasks);
         task = &tasks[idx];
 
+        // nothing to run, let interrupts wake some task up
+        if (idx == start && (!task->active || task->waits_for != -1 ||
+                             task->wait_chan || task->sleep_until > now)) {
+            cpu_idle();
+            now = pit_get_msecs();
+        }
+
         if (!task->active)
             continue;
 
         if (task->waits_for != -1)
             continue;
 
+        // a timed wait ends when the time is up
+        if (task->wait_chan) {
+            if (!task->sleep_until || task->sleep_until > now)
+                continue;
+            task->wait_chan = NULL;
+        }
+
         if (task->sleep_until > now)
             continue;
 
@@ -130,14 +152,14 @@ task_spawn(uintptr_t entry, int argc, char **argv)
     struct task *task;
     int idx;
 
-    task = ARRAY_TAKE(tasks);
+    task = ARRAY_POOL_TAKE(tasks);
     if (!task) {
         return -1;
     }
 
     // fail on pid overflow
     if (task_next_pid <= 0) {
-        ARRAY_RELEASE(task);
+        ARRAY_POOL_RELEASE(tasks, task);
         return -1;
     }
 
@@ -146,6 +168,7 @@ task_spawn(uintptr_t entry, int argc, char **argv)
     task->pid = task_next_pid++;
     task->exit_req = 0;
     task->waits_for = -1;
+    task->wait_chan = NULL;
     task->sleep_until = 0;
     task->rflags = TASK_RFLAGS;
     task->rip = (uint64_t)entry;
@@ -153,6 +176,14 @@ task_spawn(uintptr_t entry, int argc, char **argv)
     task->regs.rdi = (uint64_t)argc;
     task->regs.rsi = (uint64_t)argv;
 
+    // share open files with the parent
+    task->fdt_borrowed = NULL;
+    fdtable_init(&task->fdt);
+    fdtable_copy(&task->fdt, &task_current->fdt);
+
+    // and the console
+    task->vt = task_current->vt;
+
     return task->pid;
 }
 
@@ -213,10 +244,44 @@ task_sleep(uint64_t msecs)
     (void)task_switch();
 }
 
+/* block current task until task_wakeup() is called on a given channel */
+void
+task_wait(const void *chan)
+{
+    task_current->wait_chan = chan;
+    task_current->sleep_until = 0;
+
+    (void)task_switch();
+}
+
+/* block current task on a channel for at most a given amount of milliseconds */
+void
+task_wait_timeout(const void *chan, uint64_t msecs)
+{
+    task_current->wait_chan = chan;
+    task_current->sleep_until = pit_get_msecs() + msecs;
+
+    (void)task_switch();
+}
+
+/* unblock all tasks waiting on a given channel */
+void
+task_wakeup(const void *chan)
+{
+    ARRAY_FOREACH(tasks, i) {
+        if (tasks[i].active && tasks[i].wait_chan == chan) {
+            tasks[i].wait_chan = NULL;
+        }
+    }
+}
+
 /* terminate current task with the given status code */
 void
 task_exit(uint8_t code)
 {
+    aio_task_exit();
+    fdtable_close_all(&task_current->fdt);
+
     task_current->exit_req = 1;
     task_current->exit_code = code;
 
@@ -236,20 +301,54 @@ task_count(void)
     return count;
 }
 
+/* return the file descriptor table used by the current task */
+struct fdtable *
+task_fdtable(void)
+{
+    return task_current->fdt_borrowed ? task_current->fdt_borrowed : &task_current->fdt;
+}
+
+/*
+ * make the current task use descriptors of another task, or its own ones
+ * again if fdt is NULL. for kernel workers doing i/o on behalf of a task
+ */
+void
+task_borrow_fdtable(struct fdtable *fdt)
+{
+    task_current->fdt_borrowed = fdt;
+}
+
+/* return the virtual console of the current task */
+int
+task_vt(void)
+{
+    return task_current->vt;
+}
+
+/* move the current task to another virtual console */
+void
+task_set_vt(int con)
+{
+    task_current->vt = con;
+}
+
 /* initialize task structures and interrupt handler */
 void
 tasks_init(void)
 {
-    ARRAY_INIT(tasks);
+    ARRAY_POOL_INIT(tasks);
 
     // first task is the kernel itself
-    tasks[0].active = 1;
-    tasks[0].exit_req = 0;
-    tasks[0].waits_for = -1;
-    tasks[0].sleep_until = 0;
-    tasks[0].pid = task_next_pid++;
-    tasks[0].rflags = TASK_RFLAGS;
-    task_current = &tasks[0];
+    task_current = ARRAY_POOL_TAKE(tasks);
+    task_current->exit_req = 0;
+    task_current->waits_for = -1;
+    task_current->wait_chan = NULL;
+    task_current->sleep_until = 0;
+    task_current->pid = task_next_pid++;
+    task_current->rflags = TASK_RFLAGS;
+    task_current->fdt_borrowed = NULL;
+    fdtable_init(&task_current->fdt);
+    task_current->vt = 0;
 
     // enable interrupt handler for switching tasks
     intr_set_handler(0x31, task_intr_handle);
@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/tmpfs.c - writable in-memory filesystem
+ *
+ * file data is stored in page-sized extents, carved from physical frames
+ * mapped one after another at TMPFS_BASE_ADDR. every file has a fixed
+ * array of maps, each of them an extent holding pointers to data extents,
+ * so both random access and appending are O(1). missing extents read as
+ * zeros. entries of all directories are kept in a single hash table keyed
+ * by the parent node and the name, and in per-directory sibling lists
+ * used for listing.
+ */
+
+#define KLOG_SUBSYS KLOG_SYS_FS
+
+#include <kernel/kernel.h>
+
+enum {
+    TMPFS_NODE_COUNT    = 256,                          // max number of nodes
+    TMPFS_EXTENT_SIZE   = 4096,                         // size of a data extent
+    TMPFS_EXTENT_PTRS   = TMPFS_EXTENT_SIZE / 8,        // pointers in a map
+    TMPFS_MAP_COUNT     = 16,                           // maps per file
+    TMPFS_FRAME_MAX     = 64,                           // max frames in use
+    TMPFS_FILE_MAX      = TMPFS_MAP_COUNT * TMPFS_EXTENT_PTRS * TMPFS_EXTENT_SIZE,
+};
+
+/* file or directory, inode handle is the index, root directory is 0 */
+struct tmpfs_node {
+    uint8_t active;
+    array_index_t next_free;
+    array_index_t next_hash;
+
+    array_index_t parent;
+    array_index_t first_child;
+    array_index_t last_child;
+    array_index_t next_sibling;
+
+    int type;
+    char name[NAME_MAX];
+    size_t size;
+    uint8_t **maps[TMPFS_MAP_COUNT];
+};
+
+/* private functions */
+static uint8_t *tmpfs_extent_alloc(void);
+static uint8_t *tmpfs_extent(struct tmpfs_node *node, size_t index, int alloc);
+static size_t tmpfs_bucket(array_index_t parent, const char *name);
+static void tmpfs_load_file_info(struct file_info *info, uintptr_t inh);
+static int tmpfs_lookup(uintptr_t sbh, uintptr_t inh, const char *name,
+                        struct file_info *dest);
+static int tmpfs_create(uintptr_t sbh, uintptr_t inh, const char *name,
+                        int type, struct file_info *dest);
+static int tmpfs_open(uintptr_t sbh, uintptr_t inh);
+static int tmpfs_close(struct file *file);
+static ssize_t tmpfs_read_dir(struct file *file, void *buf, size_t nbyte);
+static ssize_t tmpfs_pread(struct file *file, void *buf, size_t nbyte, size_t off);
+static ssize_t tmpfs_read(struct file *file, void *buf, size_t nbyte);
+static ssize_t tmpfs_pwrite(struct file *file, const void *buf, size_t nbyte, size_t off);
+static ssize_t tmpfs_write(struct file *file, const void *buf, size_t nbyte);
+static int tmpfs_stat(struct file *file, struct file_info *info);
+static int tmpfs_seek(struct file *file, size_t pos);
+static ssize_t tmpfs_map(struct file *file, const void **addr, size_t nbyte);
+
+/* file operations */
+static struct file_ops tmpfs_file_ops = {
+    .close_fn = &tmpfs_close,
+    .read_fn = &tmpfs_read,
+    .write_fn = &tmpfs_write,
+    .stat_fn = &tmpfs_stat,
+    .seek_fn = &tmpfs_seek,
+    .pread_fn = &tmpfs_pread,
+    .pwrite_fn = &tmpfs_pwrite,
+    .map_fn = &tmpfs_map,
+};
+
+/* vfs operations */
+static struct vfs_ops tmpfs_ops = {
+    .open_fn = &tmpfs_open,
+    .lookup_fn = &tmpfs_lookup,
+    .create_fn = &tmpfs_create,
+};
+
+/* array of nodes and the hash table of directory entries */
+static struct tmpfs_node tmpfs_nodes[TMPFS_NODE_COUNT];
+static ARRAY_POOL_HEAD(tmpfs_nodes);
+static array_index_t tmpfs_buckets[TMPFS_NODE_COUNT];
+
+/* extent allocator state */
+static uintptr_t tmpfs_carve_ptr;
+static uintptr_t tmpfs_carve_end;
+static size_t tmpfs_frames;
+
+/* data of missing extents */
+static const uint8_t tmpfs_zero[TMPFS_EXTENT_SIZE];
+
+/* allocate a zeroed extent, map a new frame if needed. return NULL if full */
+static uint8_t *
+tmpfs_extent_alloc(void)
+{
+    uintptr_t paddr, vaddr;
+    uint8_t *ret;
+
+    if (tmpfs_carve_ptr == tmpfs_carve_end) {
+        if (tmpfs_frames == TMPFS_FRAME_MAX || !(paddr = pmem_alloc())) {
+            printk(KERN_WARN, "tmpfs: out of memory\n");
+            return NULL;
+        }
+
+        vaddr = TMPFS_BASE_ADDR + tmpfs_frames * MEM_PAGE_SIZE;
+        ptt_map(vaddr, paddr, 0, 1);
+        ++tmpfs_frames;
+
+        tmpfs_carve_ptr = vaddr;
+        tmpfs_carve_end = vaddr + MEM_PAGE_SIZE;
+    }
+
+    ret = (uint8_t *)tmpfs_carve_ptr;
+    tmpfs_carve_ptr += TMPFS_EXTENT_SIZE;
+
+    memset(ret, 0, TMPFS_EXTENT_SIZE);
+
+    return ret;
+}
+
+/* return a data extent with a given index, optionally allocating it */
+static uint8_t *
+tmpfs_extent(struct tmpfs_node *node, size_t index, int alloc)
+{
+    uint8_t ***map;
+    uint8_t **ext;
+
+    if (index >= TMPFS_MAP_COUNT * TMPFS_EXTENT_PTRS) {
+        return NULL;
+    }
+
+    map = &node->maps[index / TMPFS_EXTENT_PTRS];
+
+    if (!*map && (!alloc || !(*map = (uint8_t **)tmpfs_extent_alloc()))) {
+        return NULL;
+    }
+
+    ext = &(*map)[index % TMPFS_EXTENT_PTRS];
+
+    if (!*ext && alloc) {
+        *ext = tmpfs_extent_alloc();
+    }
+
+    return *ext;
+}
+
+/* return a hash bucket of a directory entry */
+static size_t
+tmpfs_bucket(array_index_t parent, const char *name)
+{
+    return (strhash(name) ^ (parent * 0x9E3779B1)) & (TMPFS_NODE_COUNT - 1);
+}
+
+/* load a file info structure for a specified node */
+static void
+tmpfs_load_file_info(struct file_info *info, uintptr_t inh)
+{
+    struct tmpfs_node *node = &tmpfs_nodes[inh];
+
+    memset(info, 0, sizeof(*info));
+
+    info->inh = inh;
+    info->type = node->type;
+    info->size = node->size;
+    strncpy(info->name, node->name, NAME_MAX);
+}
+
+/* find an entry in a given directory */
+static int
+tmpfs_lookup(uintptr_t sbh, uintptr_t inh, const char *name,
+             struct file_info *dest)
+{
+    array_index_t i = tmpfs_buckets[tmpfs_bucket(inh, name)];
+
+    for (; i != ARRAY_INDEX_NONE; i = tmpfs_nodes[i].next_hash) {
+        if (tmpfs_nodes[i].parent == (array_index_t)inh &&
+            !strcmp(tmpfs_nodes[i].name, name)) {
+
+            tmpfs_load_file_info(dest, i);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* create a new file or directory in a given directory */
+static int
+tmpfs_create(uintptr_t sbh, uintptr_t inh, const char *name,
+             int type, struct file_info *dest)
+{
+    struct tmpfs_node *dir = &tmpfs_nodes[inh];
+    struct tmpfs_node *node;
+    array_index_t idx;
+    size_t bucket;
+
+    if (dir->type != FT_DIR || strlen(name) >= NAME_MAX) {
+        return -1;
+    }
+
+    if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        return -1;
+    }
+
+    if (!(node = ARRAY_POOL_TAKE(tmpfs_nodes))) {
+        printk(KERN_WARN, "tmpfs: too many files\n");
+        return -1;
+    }
+
+    idx = node - tmpfs_nodes;
+
+    strncpy(node->name, name, NAME_MAX);
+    node->type = type;
+    node->size = 0;
+    node->parent = inh;
+    node->first_child = ARRAY_INDEX_NONE;
+    node->last_child = ARRAY_INDEX_NONE;
+    node->next_sibling = ARRAY_INDEX_NONE;
+    memset(node->maps, 0, sizeof(node->maps));
+
+    // append to the directory listing
+    if (dir->last_child == ARRAY_INDEX_NONE) {
+        dir->first_child = idx;
+    } else {
+        tmpfs_nodes[dir->last_child].next_sibling = idx;
+    }
+    dir->last_child = idx;
+
+    // insert into the hash table
+    bucket = tmpfs_bucket(inh, name);
+    node->next_hash = tmpfs_buckets[bucket];
+    tmpfs_buckets[bucket] = idx;
+
+    tmpfs_load_file_info(dest, idx);
+
+    return 0;
+}
+
+/* initialize a file object for a given node */
+static int
+tmpfs_open(uintptr_t sbh, uintptr_t inh)
+{
+    return file_new(sbh, inh, &tmpfs_file_ops);
+}
+
+/* close a file */
+static int
+tmpfs_close(struct file *file)
+{
+    file_release(file);
+    return 0;
+}
+
+/*
+ * read as many directory entries as fit in a buffer. the position is the
+ * node of the last returned entry, 0 is the root which is never a child
+ */
+static ssize_t
+tmpfs_read_dir(struct file *file, void *buf, size_t nbyte)
+{
+    struct file_info info;
+    array_index_t i;
+    size_t count = 0;
+
+    if (file->pos) {
+        i = tmpfs_nodes[file->pos].next_sibling;
+    } else {
+        i = tmpfs_nodes[file->inh].first_child;
+    }
+
+    for (; i != ARRAY_INDEX_NONE; i = tmpfs_nodes[i].next_sibling) {
+        if (nbyte - count < sizeof(info)) {
+            break;
+        }
+
+        tmpfs_load_file_info(&info, i);
+        memcpy((uint8_t *)buf + count, &info, sizeof(info));
+        count += sizeof(info);
+        file->pos = i;
+    }
+
+    return count;
+}
+
+/* read data at a given offset of a regular file */
+static ssize_t
+tmpfs_pread(struct file *file, void *buf, size_t nbyte, size_t off)
+{
+    struct tmpfs_node *node = &tmpfs_nodes[file->inh];
+    size_t done = 0;
+    size_t len, ofs;
+    uint8_t *ext;
+
+    if (node->type != FT_REG) {
+        return -1;
+    }
+
+    if (off >= node->size) {
+        return 0;
+    }
+
+    if (nbyte > node->size - off) {
+        nbyte = node->size - off;
+    }
+
+    while (done < nbyte) {
+        ofs = (off + done) % TMPFS_EXTENT_SIZE;
+        len = TMPFS_EXTENT_SIZE - ofs;
+        len = (len < nbyte - done) ? len : nbyte - done;
+
+        ext = tmpfs_extent(node, (off + done) / TMPFS_EXTENT_SIZE, 0);
+        memcpy((uint8_t *)buf + done, (ext ? ext : tmpfs_zero) + ofs, len);
+
+        done += len;
+    }
+
+    return done;
+}
+
+/* read data to a memory buffer */
+static ssize_t
+tmpfs_read(struct file *file, void *buf, size_t nbyte)
+{
+    ssize_t ret;
+
+    if (tmpfs_nodes[file->inh].type == FT_DIR) {
+        return tmpfs_read_dir(file, buf, nbyte);
+    }
+
+    ret = tmpfs_pread(file, buf, nbyte, file->pos);
+
+    if (ret > 0) {
+        file->pos += ret;
+    }
+
+    return ret;
+}
+
+/* write data at a given offset of a regular file, extending it if needed */
+static ssize_t
+tmpfs_pwrite(struct file *file, const void *buf, size_t nbyte, size_t off)
+{
+    struct tmpfs_node *node = &tmpfs_nodes[file->inh];
+    size_t done = 0;
+    size_t len, ofs;
+    uint8_t *ext;
+
+    if (node->type != FT_REG) {
+        return -1;
+    }
+
+    while (done < nbyte) {
+        ofs = (off + done) % TMPFS_EXTENT_SIZE;
+        len = TMPFS_EXTENT_SIZE - ofs;
+        len = (len < nbyte - done) ? len : nbyte - done;
+
+        if (!(ext = tmpfs_extent(node, (off + done) / TMPFS_EXTENT_SIZE, 1))) {
+            break;
+        }
+
+        memcpy(ext + ofs, (uint8_t *)buf + done, len);
+
+        done += len;
+
+        if (off + done > node->size) {
+            node->size = off + done;
+        }
+    }
+
+    return (done || !nbyte) ? (ssize_t)done : -1;
+}
+
+/* write data at the current position, extending the file if needed */
+static ssize_t
+tmpfs_write(struct file *file, const void *buf, size_t nbyte)
+{
+    ssize_t ret = tmpfs_pwrite(file, buf, nbyte, file->pos);
+
+    if (ret > 0) {
+        file->pos += ret;
+    }
+
+    return ret;
+}
+
+/* load a file info structure of an open file */
+static int
+tmpfs_stat(struct file *file, struct file_info *info)
+{
+    tmpfs_load_file_info(info, file->inh);
+    return 0;
+}
+
+/* validate a new position, directories can only be rewound */
+static int
+tmpfs_seek(struct file *file, size_t pos)
+{
+    if (tmpfs_nodes[file->inh].type == FT_DIR) {
+        return pos ? -1 : 0;
+    }
+
+    return (pos > TMPFS_FILE_MAX) ? -1 : 0;
+}
+
+/* map data at the current position, up to the end of its extent */
+static ssize_t
+tmpfs_map(struct file *file, const void **addr, size_t nbyte)
+{
+    struct tmpfs_node *node = &tmpfs_nodes[file->inh];
+    size_t ofs = file->pos % TMPFS_EXTENT_SIZE;
+    uint8_t *ext;
+
+    if (node->type != FT_REG) {
+        return -1;
+    }
+
+    if (file->pos >= node->size) {
+        return 0;
+    }
+
+    if (nbyte > node->size - file->pos) {
+        nbyte = node->size - file->pos;
+    }
+
+    if (nbyte > TMPFS_EXTENT_SIZE - ofs) {
+        nbyte = TMPFS_EXTENT_SIZE - ofs;
+    }
+
+    ext = tmpfs_extent(node, file->pos / TMPFS_EXTENT_SIZE, 0);
+    *addr = (ext ? ext : tmpfs_zero) + ofs;
+
+    return nbyte;
+}
+
+/* mount a tmp filesystem */
+int
+tmpfs_mount(const char *volume)
+{
+    struct tmpfs_node *root;
+
+    ARRAY_POOL_INIT(tmpfs_nodes);
+
+    ARRAY_FOREACH(tmpfs_buckets, i) {
+        tmpfs_buckets[i] = ARRAY_INDEX_NONE;
+    }
+
+    // the first node is the root directory
+    root = ARRAY_POOL_TAKE(tmpfs_nodes);
+    memset(root->name, 0, sizeof(root->name));
+    root->type = FT_DIR;
+    root->size = 0;
+    root->parent = 0;
+    root->first_child = ARRAY_INDEX_NONE;
+    root->last_child = ARRAY_INDEX_NONE;
+    root->next_sibling = ARRAY_INDEX_NONE;
+    root->next_hash = ARRAY_INDEX_NONE;
+
+    return vfs_mount(volume, &tmpfs_ops, 0);
+}
@@ -13,15 +13,52 @@
 enum {
     UART_COM1   = 0x3F8,    // COM1 base address
     UART_THR    = 0,        // transmitter holding register
+    UART_RBR    = 0,        // receiver buffer register
     UART_DLL    = 0,        // divisor latch low byte register
     UART_IER    = 1,        // interrupt enable register
     UART_DLH    = 1,        // divisor latch high byte register
+    UART_IIR    = 2,        // interrupt identification register
     UART_FCR    = 2,        // fifo control register
     UART_LCR    = 3,        // line control register
     UART_MCR    = 4,        // modem control register
     UART_LSR    = 5,        // line status register
 };
 
+/* interrupt line and sizes */
+enum {
+    UART_IRQ        = 4,        // irq of COM1
+    UART_FIFO_SIZE  = 16,       // bytes accepted when the fifo is empty
+    UART_TX_SIZE    = 4096,     // transmit ring, power of two
+    UART_RX_SIZE    = 4096,     // receive ring, power of two
+};
+
+/* interrupt enable and identification bits */
+enum {
+    UART_IER_RDA    = 0x01,     // received data available
+    UART_IER_THRE   = 0x02,     // transmitter holding register empty
+    UART_IIR_NONE   = 0x01,     // no interrupt pending
+    UART_IIR_MASK   = 0x0E,     // interrupt type
+    UART_IIR_THRE   = 0x02,
+    UART_LSR_DR     = 0x01,     // data ready
+};
+
+/* transmit ring, filled by writers and drained by the interrupt handler */
+static uint8_t uart_tx_buf[UART_TX_SIZE];
+static volatile size_t uart_tx_head;
+static volatile size_t uart_tx_tail;
+static uint8_t uart_tx_intr;        // transmission is interrupt driven
+
+/* receive ring, filled by the interrupt handler */
+static uint8_t uart_rx_buf[UART_RX_SIZE];
+static volatile size_t uart_rx_head;
+static volatile size_t uart_rx_tail;
+
+/* private functions */
+static void uart_tx_fill(uint16_t port);
+static void uart_tx_put(uint16_t port, char c);
+static void uart_rx_drain(uint16_t port);
+static void uart_handler(uint8_t intno, struct intr_stack *intr_stack, struct regs *regs);
+
 /* write to the specified register of the specified port */
 static inline void
 uart_reg_write(uint16_t port, uint8_t reg, uint8_t val)
@@ -44,12 +81,73 @@ uart_thr_empty(uint16_t port)
     return status & 0x20;
 }
 
-/* write a character to the specified port */
+/* move bytes from the transmit ring to the fifo if it's empty */
 static void
-uart_thr_write(uint16_t port, char c)
+uart_tx_fill(uint16_t port)
 {
-    while (!uart_thr_empty(port)) {};
-    uart_reg_write(port, UART_THR, c);
+    if (!uart_thr_empty(port)) {
+        return;
+    }
+
+    for (int i = 0; i < UART_FIFO_SIZE && uart_tx_head != uart_tx_tail; ++i) {
+        uart_reg_write(port, UART_THR, uart_tx_buf[uart_tx_head++ & (UART_TX_SIZE - 1)]);
+    }
+}
+
+/* append a character to the transmit ring, wait for the fifo while it's full */
+static void
+uart_tx_put(uint16_t port, char c)
+{
+    while (uart_tx_tail - uart_tx_head == UART_TX_SIZE) {
+        uart_tx_fill(port);
+    }
+
+    uart_tx_buf[uart_tx_tail++ & (UART_TX_SIZE - 1)] = c;
+}
+
+/* move received bytes from the fifo to the receive ring, drop them if it's full */
+static void
+uart_rx_drain(uint16_t port)
+{
+    static uint8_t cr = 0;
+    uint8_t c;
+
+    while (uart_reg_read(port, UART_LSR) & UART_LSR_DR) {
+        c = uart_reg_read(port, UART_RBR);
+
+        // terminals send carriage return for the enter key, some with a line feed
+        if (c == '\n' && cr) {
+            cr = 0;
+            continue;
+        }
+
+        cr = c == '\r';
+        c = cr ? '\n' : c;
+
+        if (uart_rx_tail - uart_rx_head < UART_RX_SIZE) {
+            uart_rx_buf[uart_rx_tail++ & (UART_RX_SIZE - 1)] = c;
+        }
+    }
+}
+
+/* handle uart interrupt */
+static void
+uart_handler(uint8_t intno, struct intr_stack *intr_stack, struct regs *regs)
+{
+    uint8_t iir;
+
+    while (!((iir = uart_reg_read(UART_COM1, UART_IIR)) & UART_IIR_NONE)) {
+        if ((iir & UART_IIR_MASK) == UART_IIR_THRE) {
+            uart_tx_fill(UART_COM1);
+        } else {
+            uart_rx_drain(UART_COM1);
+        }
+    }
+
+    if (uart_rx_head != uart_rx_tail) {
+        task_wakeup(uart_rx_buf);
+        file_poll_wakeup();
+    }
 }
 
 /* initialize the specified port */
@@ -62,9 +160,9 @@ uart_port_init(uint16_t port)
     // enable DLAB (divisor latch access bit)
     cpu_outb(port + UART_LCR, 0x80);
 
-    // set divisor to 0x0003
-    // 115200 BPS / 0x0003 = 38400 BPS
-    cpu_outb(port + UART_DLL, 0x03);
+    // set divisor to 0x0001
+    // 115200 BPS / 0x0001 = 115200 BPS
+    cpu_outb(port + UART_DLL, 0x01);
     cpu_outb(port + UART_DLH, 0x00);
 
     // disable DLAB, disable parity bit, set one stop bit, set 8-bit word
@@ -73,26 +171,103 @@ uart_port_init(uint16_t port)
     // clear and enable FIFO, set 14-byte interrupt trigger level
     cpu_outb(port + UART_FCR, 0xC7);
 
-    // set RTS and DTR
-    cpu_outb(port + UART_MCR, 0x03);
+    // set RTS, DTR and OUT2, which connects the interrupt line
+    cpu_outb(port + UART_MCR, 0x0B);
 }
 
-/* public interface  to write string to the default serial port (COM1) */
+/*
+ * public interface to write string to the default serial port (COM1).
+ * returns once the string is queued, unless the transmit ring is full
+ */
 void
 uart_write(const char *msg, size_t nbytes)
 {
+    uint64_t flags;
+
+    flags = cpu_get_flags();
+    cpu_cli();
+
     while (nbytes--) {
         char c = *msg++;
         if (c == '\n') {
-            uart_thr_write(UART_COM1, '\r');
+            uart_tx_put(UART_COM1, '\r');
         }
-        uart_thr_write(UART_COM1, c);
+        uart_tx_put(UART_COM1, c);
+    }
+
+    // start the transmission, the interrupt handler continues it
+    uart_tx_fill(UART_COM1);
+
+    cpu_set_flags(flags);
+
+    if (!uart_tx_intr) {
+        uart_sync();
     }
 }
 
+/*
+ * read received bytes from the default serial port, as many as are buffered
+ * up to nbyte. blocks until there is at least one. returns their amount
+ */
+size_t
+uart_read(void *buf, size_t nbyte)
+{
+    uint64_t flags;
+    size_t count = 0;
+
+    flags = cpu_get_flags();
+    cpu_cli();
+
+    while (nbyte && uart_rx_head == uart_rx_tail) {
+        task_wait(uart_rx_buf);
+    }
+
+    while (count < nbyte && uart_rx_head != uart_rx_tail) {
+        ((uint8_t *)buf)[count++] = uart_rx_buf[uart_rx_head++ & (UART_RX_SIZE - 1)];
+    }
+
+    cpu_set_flags(flags);
+
+    return count;
+}
+
+/* return amount of received bytes waiting in the buffer */
+size_t
+uart_pending(void)
+{
+    return uart_rx_tail - uart_rx_head;
+}
+
+/* transmit everything queued, without relying on interrupts */
+void
+uart_sync(void)
+{
+    uint64_t flags;
+
+    flags = cpu_get_flags();
+    cpu_cli();
+
+    while (uart_tx_head != uart_tx_tail) {
+        uart_tx_fill(UART_COM1);
+    }
+
+    cpu_set_flags(flags);
+}
+
 /* initialize uart driver */
 void
 uart_init(void)
 {
     uart_port_init(UART_COM1);
 }
+
+/* transmit and receive from the interrupt handler from now on */
+void
+uart_intr_init(void)
+{
+    intr_set_handler(0x20 + UART_IRQ, uart_handler);
+
+    // interrupt when the fifo can take more data or received some
+    uart_reg_write(UART_COM1, UART_IER, UART_IER_THRE | UART_IER_RDA);
+    uart_tx_intr = 1;
+}
@@ -7,11 +7,15 @@
  * kernel/vfs.c - virtual filesystem switch
  */
 
+#define KLOG_SUBSYS KLOG_SYS_FS
+
 #include <kernel/kernel.h>
 
 /* mount point info */
 struct vfs_mountpoint {
     uint8_t active;
+    array_index_t next_free;
+    array_index_t next_hash;
     char volume[PATH_MAX];
     uintptr_t sbh;
     struct vfs_ops *ops;
@@ -25,10 +29,14 @@ static int vfs_find_name(struct vfs_mountpoint *mp, struct file_info *parent,
                          const char *name, struct file_info *dest);
 static int vfs_find_path(struct vfs_mountpoint *mp, const char *path,
                          struct file_info *dest);
+static int vfs_create_path(struct vfs_mountpoint *mp, const char *path,
+                           struct file_info *dest);
 static struct vfs_mountpoint *vfs_find_mountpoint(const char *path);
 
 /* array of the mountpoints */
 static struct vfs_mountpoint vfs_mountpoints[8];
+static ARRAY_POOL_HEAD(vfs_mountpoints);
+static ARRAY_HASH_HEAD(vfs_mountpoints, 8);
 
 /* get the length of the first component of a path. return -1 on invalid path */
 static ssize_t
@@ -82,7 +90,7 @@ vfs_path_first(char buf[NAME_MAX], const char *path)
 int
 vfs_mount(const char *volume, struct vfs_ops *ops, uintptr_t sbh)
 {
-    struct vfs_mountpoint *mp = ARRAY_TAKE(vfs_mountpoints);
+    struct vfs_mountpoint *mp = ARRAY_POOL_TAKE(vfs_mountpoints);
 
     if (!mp) {
         printk(KERN_WARN, "cannot mount %s, too many filesystems\n", volume);
@@ -92,6 +100,7 @@ vfs_mount(const char *volume, struct vfs_ops *ops, uintptr_t sbh)
     vfs_path_first(mp->volume, volume);
     mp->ops = ops;
     mp->sbh = sbh;
+    ARRAY_HASH_INSERT(vfs_mountpoints, mp, volume);
 
     return 0;
 }
@@ -107,7 +116,7 @@ vfs_find_mountpoint(const char *path)
         return NULL;
     }
 
-    return ARRAY_FIND_BY(vfs_mountpoints, volume, buf, &i);
+    return ARRAY_HASH_FIND_BY(vfs_mountpoints, volume, buf, &i);
 }
 
 /* find a file with a given name in a given parent directory  */
@@ -115,8 +124,14 @@ static int
 vfs_find_name(struct vfs_mountpoint *mp, struct file_info *parent,
               const char *name, struct file_info *dest)
 {
-    int found = 0;
-    struct file_info info;
+    struct file_info info[8];
+    ssize_t count;
+    int found = -1;
+
+    // let the filesystem find the name on its own if it can
+    if (mp->ops->lookup_fn) {
+        return mp->ops->lookup_fn(mp->sbh, parent->inh, name, dest);
+    }
 
     int fd = mp->ops->open_fn(mp->sbh, parent->inh);
 
@@ -124,20 +139,22 @@ vfs_find_name(struct vfs_mountpoint *mp, struct file_info *parent,
         return -1;
     }
 
-    while(file_read(fd, &info, sizeof(info))) {
-        if (!strcmp(info.name, name)) {
-            found = 1;
-            break;
+    while (found < 0 && (count = file_read(fd, info, sizeof(info))) > 0) {
+        for (size_t i = 0; i < count / sizeof(info[0]); ++i) {
+            if (!strcmp(info[i].name, name)) {
+                found = i;
+                break;
+            }
         }
     }
 
     file_close(fd);
 
-    if (!found) {
+    if (found < 0) {
         return -1;
     }
 
-    memcpy(dest, &info, sizeof(info));
+    memcpy(dest, &info[found], sizeof(info[found]));
 
     return 0;
 }
@@ -199,9 +216,55 @@ vfs_find_path(struct vfs_mountpoint *mp, const char *path, struct file_info *des
     return 0;
 }
 
-/* open a file with a given path */
+/* create a file with a given path on a given mountpoint, if supported */
+static int
+vfs_create_path(struct vfs_mountpoint *mp, const char *path, struct file_info *dest)
+{
+    char buf[PATH_MAX];
+    char name[NAME_MAX];
+    struct file_info parent;
+    const char *last = NULL;
+    size_t len = strlen(path);
+    int type = (len && path[len - 1] == '/') ? FT_DIR : FT_REG;
+
+    if (!mp->ops->create_fn) {
+        return -1;
+    }
+
+    // find the last path component
+    for (const char *p = path; p && p[0] && strcmp(p, "/"); p = vfs_path_next(p)) {
+        last = p;
+    }
+
+    if (!last || (size_t)(last - path) >= sizeof(buf)) {
+        return -1;
+    }
+
+    if (vfs_path_first(name, last) < 0 || !name[0]) {
+        return -1;
+    }
+
+    // find the parent directory
+    strncpy(buf, path, last - path);
+    buf[last - path] = 0;
+
+    if (vfs_find_path(mp, buf, &parent) || parent.type != FT_DIR) {
+        return -1;
+    }
+
+    return mp->ops->create_fn(mp->sbh, parent.inh, name, type, dest);
+}
+
+/* open an existing file with a given path */
 int
 vfs_open(const char *path)
+{
+    return vfs_open_flags(path, 0);
+}
+
+/* open a file with a given path, VFS_CREATE creates it if it's missing */
+int
+vfs_open_flags(const char *path, int flags)
 {
     struct file_info info;
     struct vfs_mountpoint *mp;
@@ -212,7 +275,8 @@ vfs_open(const char *path)
 
     path = vfs_path_next(path);
 
-    if (vfs_find_path(mp, path, &info)) {
+    if (vfs_find_path(mp, path, &info) &&
+        (!(flags & VFS_CREATE) || vfs_create_path(mp, path, &info))) {
         return -1;
     }
 
@@ -223,5 +287,6 @@ vfs_open(const char *path)
 void
 vfs_init(void)
 {
-    ARRAY_INIT(vfs_mountpoints);
+    ARRAY_POOL_INIT(vfs_mountpoints);
+    ARRAY_HASH_INIT(vfs_mountpoints);
 }
@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2014-2015 Łukasz S.
+ * Distributed under the terms of GPL-2 License.
+ */
+
+/*
+ * kernel/virtio.c - virtio block device driver (legacy pci interface)
+ *
+ * requests submitted by the block layer are kept in a list sorted by
+ * sector and only handed to the device when the block layer kicks the
+ * driver. runs of adjacent requests going in the same direction are
+ * merged into one device request with a scatter-gather descriptor chain,
+ * and the device is notified once per batch. completions are reaped from
+ * the used ring in the interrupt handler, which also starts whatever was
+ * waiting for free descriptors.
+ */
+
+#define KLOG_SUBSYS KLOG_SYS_BLK
+
+#include <kernel/kernel.h>
+
+/* pci ids and legacy i/o registers */
+enum {
+    VIRTIO_VENDOR           = 0x1AF4,
+    VIRTIO_DEVICE_BLK       = 0x1001,
+
+    VIRTIO_REG_FEATURES     = 0x00,
+    VIRTIO_REG_GUEST_FEAT   = 0x04,
+    VIRTIO_REG_QUEUE_PFN    = 0x08,
+    VIRTIO_REG_QUEUE_SIZE   = 0x0C,
+    VIRTIO_REG_QUEUE_SEL    = 0x0E,
+    VIRTIO_REG_QUEUE_NOTIFY = 0x10,
+    VIRTIO_REG_STATUS       = 0x12,
+    VIRTIO_REG_ISR          = 0x13,
+    VIRTIO_REG_BLK_CAPACITY = 0x14,
+};
+
+/* device status bits, descriptor flags and request types */
+enum {
+    VIRTIO_STATUS_ACK       = 0x01,
+    VIRTIO_STATUS_DRIVER    = 0x02,
+    VIRTIO_STATUS_DRIVER_OK = 0x04,
+    VIRTIO_STATUS_FAILED    = 0x80,
+
+    VRING_DESC_F_NEXT       = 0x01,
+    VRING_DESC_F_WRITE      = 0x02,
+    VRING_ALIGN             = 4096,
+
+    VIRTIO_BLK_T_IN         = 0,
+    VIRTIO_BLK_T_OUT        = 1,
+};
+
+enum {
+    VBLK_QUEUE_MAX          = 256,  // max supported queue size
+    VBLK_SEG_MAX            = 16,   // max requests merged into one chain
+};
+
+/* virtqueue descriptor */
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+/* ring of descriptor chains made available to the device */
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+/* ring of descriptor chains returned by the device */
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct {
+        uint32_t id;
+        uint32_t len;
+    } ring[];
+};
+
+/* state of a device request, indexed by the head of its descriptor chain */
+struct vblk_slot {
+    struct {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t sector;
+    } hdr;
+    uint8_t status;
+    struct blk_req *reqs;           // merged block layer requests
+};
+
+/* the device */
+static struct vblk {
+    uint16_t io;
+    uint16_t qsz;
+
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    struct vblk_slot *slots;
+
+    uint16_t free_head;             // list of free descriptors
+    uint16_t free_count;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+
+    struct blk_req *pending;        // not started yet, sorted by sector
+} vblk;
+
+/* private functions */
+static void *vblk_alloc(size_t size);
+static uint16_t vblk_desc_take(void);
+static void vblk_desc_set(uint16_t d, void *addr, size_t len, uint16_t flags);
+static int vblk_chain(void);
+static void vblk_start(void);
+static void vblk_reap(void);
+static void vblk_handler(uint8_t intno, struct intr_stack *intr_stack, struct regs *regs);
+static int vblk_submit(uintptr_t drvh, struct blk_req *req);
+static void vblk_kick(uintptr_t drvh);
+static int vblk_setup(void);
+
+/* block device operations */
+static struct blk_ops vblk_ops = {
+    .submit_fn = &vblk_submit,
+    .kick_fn = &vblk_kick,
+};
+
+/*
+ * allocate zeroed memory aligned to a power of two not smaller than its
+ * size, so it doesn't cross a physical frame and is contiguous for dma
+ */
+static void *
+vblk_alloc(size_t size)
+{
+    size_t align = 16;
+    uintptr_t p;
+
+    while (align < size) {
+        align <<= 1;
+    }
+
+    if (!(p = (uintptr_t)kheap_alloc(align * 2))) {
+        return NULL;
+    }
+
+    p = (p + align - 1) & ~(align - 1);
+    memset((void *)p, 0, size);
+
+    return (void *)p;
+}
+
+/* take a descriptor from the free list */
+static uint16_t
+vblk_desc_take(void)
+{
+    uint16_t d = vblk.free_head;
+
+    vblk.free_head = vblk.desc[d].next;
+    vblk.free_count--;
+
+    return d;
+}
+
+/* fill a descriptor with a buffer */
+static void
+vblk_desc_set(uint16_t d, void *addr, size_t len, uint16_t flags)
+{
+    vblk.desc[d].addr = ptt_paddr((uintptr_t)addr);
+    vblk.desc[d].len = len;
+    vblk.desc[d].flags = flags;
+}
+
+/*
+ * move the first pending request together with following adjacent ones
+ * to a descriptor chain and make it available. return 0 on success or -1
+ * if there are not enough free descriptors
+ */
+static int
+vblk_chain(void)
+{
+    struct blk_req *first = vblk.pending;
+    struct blk_req *last = first;
+    struct vblk_slot *slot;
+    uint16_t head, prev, d;
+    size_t n = 1;
+
+    while (n < VBLK_SEG_MAX && last->next && last->next->write == first->write &&
+           last->next->sector == last->sector + last->count) {
+        last = last->next;
+        n++;
+    }
+
+    // header, data and status descriptors
+    if (vblk.free_count < n + 2) {
+        return -1;
+    }
+
+    vblk.pending = last->next;
+    last->next = NULL;
+
+    head = vblk_desc_take();
+    slot = &vblk.slots[head];
+    slot->hdr.type = first->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    slot->hdr.reserved = 0;
+    slot->hdr.sector = first->sector;
+    slot->status = 0xFF;
+    slot->reqs = first;
+
+    vblk_desc_set(head, &slot->hdr, sizeof(slot->hdr), VRING_DESC_F_NEXT);
+    prev = head;
+
+    for (struct blk_req *req = first; req; req = req->next) {
+        d = vblk_desc_take();
+        vblk_desc_set(d, req->buf, req->count * BLK_SECTOR_SIZE,
+                      VRING_DESC_F_NEXT | (req->write ? 0 : VRING_DESC_F_WRITE));
+        vblk.desc[prev].next = d;
+        prev = d;
+    }
+
+    d = vblk_desc_take();
+    vblk_desc_set(d, &slot->status, 1, VRING_DESC_F_WRITE);
+    vblk.desc[prev].next = d;
+
+    vblk.avail->ring[vblk.avail_idx & (vblk.qsz - 1)] = head;
+    vblk.avail_idx++;
+
+    return 0;
+}
+
+/* start as many pending requests as possible, notify the device once */
+static void
+vblk_start(void)
+{
+    uint16_t idx = vblk.avail_idx;
+
+    while (vblk.pending && !vblk_chain());
+
+    if (idx == vblk.avail_idx) {
+        return;
+    }
+
+    // the ring entries must be visible before the index
+    __atomic_store_n(&vblk.avail->idx, vblk.avail_idx, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    cpu_outw(vblk.io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+}
+
+/* complete requests returned by the device and free their descriptors */
+static void
+vblk_reap(void)
+{
+    struct vblk_slot *slot;
+    struct blk_req *req, *next;
+    uint16_t d, head;
+    int status;
+
+    while (vblk.used_idx != __atomic_load_n(&vblk.used->idx, __ATOMIC_ACQUIRE)) {
+        head = vblk.used->ring[vblk.used_idx & (vblk.qsz - 1)].id;
+        vblk.used_idx++;
+
+        slot = &vblk.slots[head];
+        status = slot->status ? -1 : 0;
+
+        // return the whole chain to the free list
+        for (d = head; vblk.desc[d].flags & VRING_DESC_F_NEXT; d = vblk.desc[d].next) {
+            vblk.free_count++;
+        }
+        vblk.desc[d].next = vblk.free_head;
+        vblk.free_head = head;
+        vblk.free_count++;
+
+        for (req = slot->reqs; req; req = next) {
+            next = req->next;
+            blk_complete(req, status);
+        }
+    }
+}
+
+/* handle the device interrupt */
+static void
+vblk_handler(uint8_t intno, struct intr_stack *intr_stack, struct regs *regs)
+{
+    // reading the isr acknowledges the interrupt
+    if (!(cpu_inb(vblk.io + VIRTIO_REG_ISR) & 1)) {
+        return;
+    }
+
+    vblk_reap();
+    vblk_start();
+}
+
+/* queue a request, it's started by the next kick */
+static int
+vblk_submit(uintptr_t drvh, struct blk_req *req)
+{
+    struct blk_req **p = &vblk.pending;
+
+    // the buffer has to stay within a physical frame
+    if (!req->count || ((uintptr_t)req->buf & (MEM_PAGE_SIZE - 1)) +
+                       req->count * BLK_SECTOR_SIZE > MEM_PAGE_SIZE) {
+        return -1;
+    }
+
+    while (*p && (*p)->sector < req->sector) {
+        p = &(*p)->next;
+    }
+
+    req->next = *p;
+    *p = req;
+
+    return 0;
+}
+
+/* start queued requests */
+static void
+vblk_kick(uintptr_t drvh)
+{
+    vblk_start();
+}
+
+/* set up the request queue. return 0 on success */
+static int
+vblk_setup(void)
+{
+    size_t used_ofs;
+    uint8_t *ring;
+
+    cpu_outw(vblk.io + VIRTIO_REG_QUEUE_SEL, 0);
+    vblk.qsz = cpu_inw(vblk.io + VIRTIO_REG_QUEUE_SIZE);
+
+    if (!vblk.qsz || vblk.qsz > VBLK_QUEUE_MAX || (vblk.qsz & (vblk.qsz - 1))) {
+        return -1;
+    }
+
+    // descriptors and the available ring, followed by the aligned used ring
+    used_ofs = sizeof(struct vring_desc) * vblk.qsz + sizeof(uint16_t) * (3 + vblk.qsz);
+    used_ofs = (used_ofs + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1);
+
+    ring = vblk_alloc(used_ofs + sizeof(uint16_t) * 3 + sizeof(vblk.used->ring[0]) * vblk.qsz);
+    vblk.slots = vblk_alloc(sizeof(struct vblk_slot) * vblk.qsz);
+
+    if (!ring || !vblk.slots) {
+        return -1;
+    }
+
+    vblk.desc = (struct vring_desc *)ring;
+    vblk.avail = (struct vring_avail *)(ring + sizeof(struct vring_desc) * vblk.qsz);
+    vblk.used = (struct vring_used *)(ring + used_ofs);
+
+    for (uint16_t i = 0; i < vblk.qsz; ++i) {
+        vblk.desc[i].next = i + 1;
+    }
+
+    vblk.free_head = 0;
+    vblk.free_count = vblk.qsz;
+    vblk.avail_idx = 0;
+    vblk.used_idx = 0;
+    vblk.pending = NULL;
+
+    cpu_outl(vblk.io + VIRTIO_REG_QUEUE_PFN, ptt_paddr((uintptr_t)ring) / VRING_ALIGN);
+
+    return 0;
+}
+
+/* detect a virtio block device and register it as a block device */
+void
+virtio_blk_init(void)
+{
+    struct pci_dev pdev;
+    uint64_t sectors;
+
+    if (pci_find(VIRTIO_VENDOR, VIRTIO_DEVICE_BLK, &pdev)) {
+        return;
+    }
+
+    // the legacy interface is in the first bar, an i/o one
+    if (!(pdev.bar[0] & 1) || pdev.irq >= 16) {
+        return;
+    }
+
+    vblk.io = pdev.bar[0] & ~3;
+    pci_enable(&pdev);
+
+    cpu_outb(vblk.io + VIRTIO_REG_STATUS, 0);
+    cpu_outb(vblk.io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+    cpu_outb(vblk.io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    // no optional features are needed
+    (void)cpu_inl(vblk.io + VIRTIO_REG_FEATURES);
+    cpu_outl(vblk.io + VIRTIO_REG_GUEST_FEAT, 0);
+
+    if (vblk_setup()) {
+        cpu_outb(vblk.io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        printk(KERN_WARN, "virtio: cannot initialize the block device\n");
+        return;
+    }
+
+    intr_set_handler(0x20 + pdev.irq, vblk_handler);
+    cpu_outb(vblk.io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER |
+                                          VIRTIO_STATUS_DRIVER_OK);
+
+    sectors = cpu_inl(vblk.io + VIRTIO_REG_BLK_CAPACITY);
+    sectors |= (uint64_t)cpu_inl(vblk.io + VIRTIO_REG_BLK_CAPACITY + 4) << 32;
+
+    (void)blk_register("vda", &vblk_ops, 0, sectors);
+}
@@ -14,6 +14,17 @@ enum {
     VT_VIDMEM = 0xB8000,
 };
 
+/* console is presented at most once per VT_FLUSH_MSECS */
+enum {
+    VT_FLUSH_MSECS = 50,
+};
+
+/* scrollback limits of each console, VT_HIST_SIZE must be a power of two */
+enum {
+    VT_HIST_SIZE = 32768,           // bytes of encoded lines
+    VT_HIST_LINES = 1024,           // max number of lines
+};
+
 /* current input state */
 enum {
     VT_ST_CHAR = 0,     // regular character
@@ -31,191 +42,586 @@ enum {
 
 /* convenience macros */
 #define VT_BUF_SIZE (VT_COLS * VT_ROWS)
-#define VT_CR_POS   (cr_y * VT_COLS + cr_x)
+#define VT_CR_POS(vt) ((vt)->cr_y * VT_COLS + (vt)->cr_x)
+#define VT_ROW(vt, y) (((vt)->top + (y)) % VT_ROWS)
+#define VT_CELL(vt, x, y) (VT_ROW(vt, y) * VT_COLS + (x))
+
+/* virtual console */
+struct vt_console {
+    uint16_t buffer[VT_BUF_SIZE];
+    uint8_t top;                    // buffer row shown at the top of the screen
+    uint8_t cr_x;
+    uint8_t cr_y;
+    uint8_t cr_attr;
+    uint8_t state;                  // input state and pending command
+    uint8_t command;
+
+    /*
+     * changed columns of each buffer row since the last flush, empty if
+     * first >= last, and the number of lines scrolled in the meantime
+     */
+    uint8_t dirty_first[VT_ROWS];
+    uint8_t dirty_last[VT_ROWS];
+    uint8_t dirty;
+    uint8_t scrolled;
+
+    /*
+     * lines scrolled out of the screen, newest last. each one is encoded as
+     * the amount of attribute runs and characters, followed by (length,
+     * attribute) pairs of the runs and the characters without trailing spaces
+     */
+    uint8_t hist_buf[VT_HIST_SIZE];
+    size_t hist_offs[VT_HIST_LINES];
+    size_t hist_start;              // position of the oldest line
+    size_t hist_end;                // position past the newest line
+    size_t hist_total;              // amount of lines ever added
+    size_t hist_count;              // amount of lines kept
+
+    /* history lines shown above the screen, and the amount requested */
+    int view;
+    volatile int view_req;
+};
 
 /* private data */
 static vt_flush_cb flush_cb = 0;
-static uint16_t buffer[VT_BUF_SIZE];
 static uint16_t *vidmem = (uint16_t*)VT_VIDMEM;
-static uint8_t cr_x = 0;
-static uint8_t cr_y = 0;
-static uint8_t cr_attr = 0x0F;
+static struct vt_console consoles[VT_COUNT];
+static struct vt_damage damage[VT_ROWS];
+static uint16_t hist_rows[VT_BUF_SIZE];
+static uint16_t cr_shown = 0;       // cursor position set in the crtc
+
+/* visible console, and the one requested from the keyboard */
+static int active = 0;
+static volatile int active_req = 0;
+
+/* presentation state, writes are flushed synchronously until the task starts */
+static uint8_t flusher = 0;
+static uint64_t flushed_at = 0;
 
 /* private functions */
-static void vt_goto(uint8_t x, uint8_t y);
-static void vt_clr(void);
-static void vt_dispatch(uint8_t cmd, uint8_t param);
-static void vt_advance(void);
-static void vt_scroll(void);
-static void vt_putc(unsigned char chr);
+static void vt_touch(struct vt_console *vt, uint8_t row, uint8_t first, uint8_t last);
+static void vt_touch_all(struct vt_console *vt);
+static void vt_goto(struct vt_console *vt, uint8_t x, uint8_t y);
+static void vt_clr(struct vt_console *vt);
+static void vt_dispatch(struct vt_console *vt, uint8_t cmd, uint8_t param);
+static void vt_advance(struct vt_console *vt);
+static void vt_scroll(struct vt_console *vt);
+static void vt_putc(struct vt_console *vt, unsigned char chr);
+static void vt_hist_push(struct vt_console *vt, const uint16_t *line);
+static uint16_t *vt_hist_line(struct vt_console *vt, size_t n, uint16_t *cells);
+static uint16_t *vt_row_cells(struct vt_console *vt, uint8_t y);
+static int vt_live_changed(struct vt_console *vt);
+static void vt_damage_add(struct vt_console *vt, int *count, uint8_t y, uint8_t first, uint8_t last);
+static void vt_cursor_update(struct vt_console *vt);
+static int vt_pending(void);
 static void vt_flush(void);
+static void vt_flusher(int argc, char **argv);
+
+/* mark columns [first, last) of a buffer row as changed */
+static void
+vt_touch(struct vt_console *vt, uint8_t row, uint8_t first, uint8_t last)
+{
+    vt->dirty = 1;
+
+    if (vt->dirty_first[row] >= vt->dirty_last[row]) {
+        vt->dirty_first[row] = first;
+        vt->dirty_last[row] = last;
+        return;
+    }
+
+    vt->dirty_first[row] = first < vt->dirty_first[row] ? first : vt->dirty_first[row];
+    vt->dirty_last[row] = last > vt->dirty_last[row] ? last : vt->dirty_last[row];
+}
+
+/* mark the whole screen as changed */
+static void
+vt_touch_all(struct vt_console *vt)
+{
+    for (uint8_t row = 0; row < VT_ROWS; ++row) {
+        vt->dirty_first[row] = 0;
+        vt->dirty_last[row] = VT_COLS;
+    }
+    vt->dirty = 1;
+}
 
 /* move cursor to the specified position */
 static void
-vt_goto(uint8_t x, uint8_t y)
+vt_goto(struct vt_console *vt, uint8_t x, uint8_t y)
 {
-    cr_x = x;
-    cr_y = y;
-    crtc_cursor_set(VT_CR_POS);
+    vt->cr_x = x;
+    vt->cr_y = y;
 }
 
 /* clear the internal buffer */
 static void
-vt_clr(void)
+vt_clr(struct vt_console *vt)
 {
-    uint16_t word = (cr_attr << 8) | ' ';
+    uint16_t word = (vt->cr_attr << 8) | ' ';
     for (size_t i = 0; i < VT_BUF_SIZE; ++i) {
-        buffer[i] = word;
+        vt->buffer[i] = word;
     }
-    vt_goto(0, 0);
+    vt_touch_all(vt);
+    vt_goto(vt, 0, 0);
 }
 
 /* dispatch command */
 static void
-vt_dispatch(uint8_t cmd, uint8_t param)
+vt_dispatch(struct vt_console *vt, uint8_t cmd, uint8_t param)
 {
     switch(cmd) {
 
     case VT_CMD_CLR:
-        vt_clr();
+        vt_clr(vt);
         break;
 
     case VT_CMD_GOTOX:
-        vt_goto(param, cr_y);
+        vt_goto(vt, param, vt->cr_y);
         break;
 
     case VT_CMD_GOTOY:
-        vt_goto(cr_x, param);
+        vt_goto(vt, vt->cr_x, param);
         break;
 
     case VT_CMD_CHATTR:
-        cr_attr = param;
+        vt->cr_attr = param;
         break;
     }
 }
 
 /* advance cursor by one character */
 static void
-vt_advance(void)
+vt_advance(struct vt_console *vt)
 {
-    cr_x += 1;
+    vt->cr_x += 1;
 
-    if (cr_x >= VT_COLS) {
-        cr_y += cr_x / VT_COLS;
-        cr_x = cr_x % VT_COLS;
+    if (vt->cr_x >= VT_COLS) {
+        vt->cr_y += vt->cr_x / VT_COLS;
+        vt->cr_x = vt->cr_x % VT_COLS;
     }
-
-    crtc_cursor_set(VT_CR_POS);
 }
 
 /* scroll buffer down to the cursor position */
 static void
-vt_scroll(void)
+vt_scroll(struct vt_console *vt)
 {
-    while (cr_y >= VT_ROWS) {
+    uint16_t *line;
 
-        for (uint8_t row = 0; row < VT_ROWS - 1; ++row) {
-            void *dst = buffer + row * VT_COLS;
-            void *src = buffer + (row + 1) * VT_COLS;
-            size_t count = sizeof(buffer[0]) * VT_COLS;
-            memcpy(dst, src, count);
-        }
+    while (vt->cr_y >= VT_ROWS) {
 
+        // the top row becomes the new bottom one
+        line = vt->buffer + vt->top * VT_COLS;
+        vt_hist_push(vt, line);
         for (int16_t i = 0; i < VT_COLS; ++i) {
-            buffer[VT_COLS * VT_ROWS - 1 - i] = cr_attr << 8 | ' ';
+            line[i] = vt->cr_attr << 8 | ' ';
         }
 
-        cr_y--;
+        vt_touch(vt, vt->top, 0, VT_COLS);
+        vt->top = (vt->top + 1) % VT_ROWS;
+        vt->scrolled += vt->scrolled < VT_ROWS;
+        vt->cr_y--;
     }
 }
 
 /* handle one character of input */
 static void
-vt_putc(unsigned char chr)
+vt_putc(struct vt_console *vt, unsigned char chr)
 {
-    static uint8_t state = VT_ST_CHAR;
-    static uint8_t command = 0;
-    static uint8_t param = 0;
-
-    switch (state) {
+    switch (vt->state) {
 
     case VT_ST_CHAR:
         if (chr == '\n') {
-            vt_goto(0, cr_y + 1);
-            vt_scroll();
+            vt_goto(vt, 0, vt->cr_y + 1);
+            vt_scroll(vt);
         } else if (chr == '\t') {
-            cr_x += 8;
-            cr_x &= ~7;
-            cr_x -= 1;
-            vt_advance();
+            vt->cr_x += 8;
+            vt->cr_x &= ~7;
+            vt->cr_x -= 1;
+            vt_advance(vt);
         } else if (chr == '\b') {
-            if (cr_x > 0) {
-                --cr_x;
-                buffer[VT_CR_POS] = (cr_attr << 8) | ' ';
-                crtc_cursor_set(VT_CR_POS);
+            if (vt->cr_x > 0) {
+                --vt->cr_x;
+                vt->buffer[VT_CELL(vt, vt->cr_x, vt->cr_y)] = (vt->cr_attr << 8) | ' ';
+                vt_touch(vt, VT_ROW(vt, vt->cr_y), vt->cr_x, vt->cr_x + 1);
             }
         } else if (chr == '\033') {
-            state = VT_ST_CMD;
+            vt->state = VT_ST_CMD;
         } else if (chr >= 32) {
-            vt_scroll();
-            buffer[VT_CR_POS] = (cr_attr << 8) | chr;
-            vt_advance();
+            vt_scroll(vt);
+            vt->buffer[VT_CELL(vt, vt->cr_x, vt->cr_y)] = (vt->cr_attr << 8) | chr;
+            vt_touch(vt, VT_ROW(vt, vt->cr_y), vt->cr_x, vt->cr_x + 1);
+            vt_advance(vt);
         }
         break;
 
     case VT_ST_CMD:
-        command = chr;
-        state = VT_ST_PARAM;
+        vt->command = chr;
+        vt->state = VT_ST_PARAM;
         break;
 
     case VT_ST_PARAM:
-        param = chr;
-        vt_dispatch(command, param);
-        state = VT_ST_CHAR;
+        vt_dispatch(vt, vt->command, chr);
+        vt->state = VT_ST_CHAR;
         break;
     }
 }
 
-/* flush internal buffer to the video memory */
+/* encode a line and append it to the history, dropping the oldest ones */
+static void
+vt_hist_push(struct vt_console *vt, const uint16_t *line)
+{
+    uint8_t rec[2 + VT_COLS * 3];
+    uint8_t runs = 0;
+    uint8_t chars = VT_COLS;
+    size_t len;
+
+    while (chars > 0 && (line[chars - 1] & 0xFF) == ' ') {
+        chars--;
+    }
+
+    for (int i = 0; i < VT_COLS; ++i) {
+        if (i && (line[i] >> 8) == rec[2 + 2 * runs - 1]) {
+            rec[2 + 2 * runs - 2]++;
+            continue;
+        }
+        rec[2 + 2 * runs] = 1;
+        rec[2 + 2 * runs + 1] = line[i] >> 8;
+        runs++;
+    }
+
+    rec[0] = runs;
+    rec[1] = chars;
+    len = 2 + 2 * runs;
+    for (int i = 0; i < chars; ++i) {
+        rec[len++] = line[i] & 0xFF;
+    }
+
+    while (vt->hist_count == VT_HIST_LINES ||
+           (vt->hist_count && vt->hist_end + len - vt->hist_start > VT_HIST_SIZE)) {
+        vt->hist_count--;
+        vt->hist_start = vt->hist_count ?
+            vt->hist_offs[(vt->hist_total - vt->hist_count) % VT_HIST_LINES] : vt->hist_end;
+    }
+
+    vt->hist_offs[vt->hist_total % VT_HIST_LINES] = vt->hist_end;
+    for (size_t i = 0; i < len; ++i) {
+        vt->hist_buf[(vt->hist_end + i) & (VT_HIST_SIZE - 1)] = rec[i];
+    }
+
+    vt->hist_end += len;
+    vt->hist_total++;
+    vt->hist_count++;
+}
+
+/* decode the n-th newest history line to cells */
+static uint16_t *
+vt_hist_line(struct vt_console *vt, size_t n, uint16_t *cells)
+{
+    size_t pos = vt->hist_offs[(vt->hist_total - 1 - n) % VT_HIST_LINES];
+    size_t chr;
+    uint8_t runs, chars, len, attr;
+    int x = 0;
+
+    runs = vt->hist_buf[pos++ & (VT_HIST_SIZE - 1)];
+    chars = vt->hist_buf[pos++ & (VT_HIST_SIZE - 1)];
+    chr = pos + 2 * runs;
+
+    while (runs--) {
+        len = vt->hist_buf[pos++ & (VT_HIST_SIZE - 1)];
+        attr = vt->hist_buf[pos++ & (VT_HIST_SIZE - 1)];
+
+        for (; len > 0; --len, ++x) {
+            cells[x] = (attr << 8) | (x < chars ? vt->hist_buf[chr++ & (VT_HIST_SIZE - 1)] : ' ');
+        }
+    }
+
+    return cells;
+}
+
+/* return cells shown in a screen row with the current view */
+static uint16_t *
+vt_row_cells(struct vt_console *vt, uint8_t y)
+{
+    if (y >= vt->view) {
+        return vt->buffer + VT_ROW(vt, y - vt->view) * VT_COLS;
+    }
+
+    return vt_hist_line(vt, vt->view - 1 - y, hist_rows + y * VT_COLS);
+}
+
+/* check if the screen contents changed since the last flush */
+static int
+vt_live_changed(struct vt_console *vt)
+{
+    if (vt->scrolled) {
+        return 1;
+    }
+
+    for (uint8_t row = 0; row < VT_ROWS; ++row) {
+        if (vt->dirty_first[row] < vt->dirty_last[row]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* add a changed span of a screen row to the damage list */
+static void
+vt_damage_add(struct vt_console *vt, int *count, uint8_t y, uint8_t first, uint8_t last)
+{
+    struct vt_damage *dmg = &damage[(*count)++];
+
+    dmg->cells = vt_row_cells(vt, y);
+    dmg->row = y;
+    dmg->first = first;
+    dmg->last = last;
+
+    memcpy(vidmem + y * VT_COLS + first, dmg->cells + first, (last - first) * 2);
+}
+
+/* program the crtc if the cursor moved, it isn't shown in graphics mode */
+static void
+vt_cursor_update(struct vt_console *vt)
+{
+    uint16_t pos = (vt->cr_y + vt->view) * VT_COLS + vt->cr_x;
+
+    if (pos == cr_shown) {
+        return;
+    }
+
+    cr_shown = pos;
+    if (!vbe_gfx_mode()) {
+        crtc_cursor_set(pos);
+    }
+}
+
+/* check if the visible console has changes to present */
+static int
+vt_pending(void)
+{
+    return consoles[active].dirty || active_req != active;
+}
+
+/* flush changed cells of the visible console to the video memory */
 static void
 vt_flush(void)
 {
-    memcpy(vidmem, buffer, VT_COLS * VT_ROWS * 2);
-    if (flush_cb) {
-        flush_cb(buffer, VT_COLS, VT_ROWS);
+    struct vt_console *vt;
+    int count = 0;
+    int shift;
+    int req;
+    uint8_t y, row;
+
+    if (!vt_pending()) {
+        return;
+    }
+
+    flushed_at = pit_get_msecs();
+
+    // a console shown again is drawn from scratch
+    if (active_req != active) {
+        active = active_req;
+        vt_touch_all(&consoles[active]);
+    }
+
+    vt = &consoles[active];
+    vt->dirty = 0;
+
+    req = vt->view_req;
+    req = req < (int)vt->hist_count ? req : (int)vt->hist_count;
+
+    if (!vt->view && !req) {
+        shift = vt->scrolled;
+    } else if (!vt_live_changed(vt)) {
+        shift = vt->view - req;
+    } else {
+        shift = VT_ROWS;
+    }
+    vt->view = req;
+
+    // video memory is linear, move the lines which are still visible
+    if (shift > 0 && shift < VT_ROWS) {
+        memmove(vidmem, vidmem + shift * VT_COLS, (VT_ROWS - shift) * VT_COLS * 2);
+    } else if (shift < 0 && shift > -VT_ROWS) {
+        memmove(vidmem - shift * VT_COLS, vidmem, (VT_ROWS + shift) * VT_COLS * 2);
+    }
+
+    // draw rows uncovered by the move and changed parts of the others
+    for (y = 0; y < VT_ROWS; ++y) {
+        if (y < -shift || y >= VT_ROWS - shift) {
+            vt_damage_add(vt, &count, y, 0, VT_COLS);
+            continue;
+        }
+
+        if (y < vt->view) {
+            continue;
+        }
+
+        row = VT_ROW(vt, y - vt->view);
+        if (vt->dirty_first[row] < vt->dirty_last[row]) {
+            vt_damage_add(vt, &count, y, vt->dirty_first[row], vt->dirty_last[row]);
+        }
+    }
+
+    for (row = 0; row < VT_ROWS; ++row) {
+        vt->dirty_first[row] = vt->dirty_last[row] = 0;
+    }
+    vt->scrolled = 0;
+
+    vt_cursor_update(vt);
+
+    if (flush_cb && (count || shift)) {
+        flush_cb(VT_COLS, VT_ROWS, shift, damage, count);
     }
 }
 
-/* handle n characters from the given buffer */
+/* present changes when they are due, at most once per frame */
+static void
+vt_flusher(int argc, char **argv)
+{
+    uint64_t flags;
+    uint64_t elapsed;
+
+    while (1) {
+        flags = cpu_get_flags();
+        cpu_cli();
+
+        while (!vt_pending()) {
+            task_wait(&flusher);
+        }
+
+        cpu_set_flags(flags);
+
+        // let more output accumulate until the next frame
+        elapsed = pit_get_msecs() - flushed_at;
+        if (elapsed < VT_FLUSH_MSECS) {
+            task_sleep(VT_FLUSH_MSECS - elapsed);
+        }
+
+        vt_flush();
+    }
+}
+
+/* handle n characters from the given buffer on a console */
 size_t
-vt_write(const char *buf, size_t n)
+vt_write(int con, const char *buf, size_t n)
 {
+    struct vt_console *vt;
+
+    if (con < 0 || con >= VT_COUNT) {
+        return 0;
+    }
+
+    vt = &consoles[con];
+
+    // output brings the view back to the screen
+    vt->view_req = 0;
+
     for (size_t i = 0; i < n; ++i) {
-        vt_putc((unsigned char)buf[i]);
+        vt_putc(vt, (unsigned char)buf[i]);
+    }
+
+    // background consoles only accumulate text until they are shown
+    if (con != active) {
+        return n;
+    }
+
+    // cursor moves and leaving the history are presented too
+    if (vt->view || (vt->cr_y + vt->view) * VT_COLS + vt->cr_x != cr_shown) {
+        vt->dirty = 1;
+    }
+
+    // tasks aren't preempted, so a writer which never blocks presents itself
+    if (!flusher || pit_get_msecs() - flushed_at >= VT_FLUSH_MSECS) {
+        vt_flush();
+    } else {
+        task_wakeup(&flusher);
     }
-    vt_flush();
 
     return n;
 }
 
+/* move the view by given amount of lines back in history, or forward if negative */
+void
+vt_scrollback(int lines)
+{
+    struct vt_console *vt = &consoles[active];
+    int req = vt->view_req + lines;
+
+    req = req < (int)vt->hist_count ? req : (int)vt->hist_count;
+    vt->view_req = req > 0 ? req : 0;
+    vt->dirty = 1;
+
+    task_wakeup(&flusher);
+}
+
+/* show another console */
+void
+vt_switch(int con)
+{
+    if (con < 0 || con >= VT_COUNT) {
+        return;
+    }
+
+    active_req = con;
+
+    task_wakeup(&flusher);
+}
+
+/* return the visible console */
+int
+vt_active(void)
+{
+    return active_req;
+}
+
+/* present all pending changes immediately */
+void
+vt_sync(void)
+{
+    vt_flush();
+}
+
 /* set flush callback */
 void
 vt_set_flush_cb(vt_flush_cb cb)
 {
     flush_cb = cb;
+
+    // the new consumer has nothing drawn yet
+    vt_touch_all(&consoles[active]);
+    vt_flush();
+}
+
+/* start presenting changes from a separate task */
+void
+vt_flush_init(void)
+{
+    kassert(task_spawn((uintptr_t)vt_flusher, 0, NULL) >= 0, "cannot start the vt flusher");
+    flusher = 1;
 }
 
 /* initialize terminal */
 void
 vt_init(void)
 {
+    struct vt_console *vt = &consoles[0];
+
     // read cursor position
     uint16_t pos = crtc_cursor_get();
-    cr_x = pos % VT_COLS;
-    cr_y = pos / VT_COLS;
+    vt->cr_x = pos % VT_COLS;
+    vt->cr_y = pos / VT_COLS;
+    vt->cr_attr = 0x0F;
+    cr_shown = pos;
 
-    // copy existing video memory to our buffer
+    // copy existing video memory to the first console
     for (int i = 0; i < (VT_COLS * VT_ROWS); ++i) {
-        buffer[i] = vidmem[i] != 0xFFFF ? vidmem[i] : 0;
+        vt->buffer[i] = vidmem[i] != 0xFFFF ? vidmem[i] : 0;
+    }
+
+    // the others start blank
+    for (int i = 1; i < VT_COUNT; ++i) {
+        consoles[i].cr_attr = 0x0F;
+        vt_clr(&consoles[i]);
     }
 }
@@ -36,6 +36,29 @@ memcpy(void *dest, const void *src, size_t n)
     return dest;
 }
 
+/*
+ * copy memory area, the areas may overlap
+ */
+void *
+memmove(void *dest, const void *src, size_t n)
+{
+    uint8_t *srcb;
+    uint8_t *destb;
+
+    // copying forward never overwrites bytes not read yet
+    if (dest <= src) {
+        return memcpy(dest, src, n);
+    }
+
+    srcb = (uint8_t *)src + n;
+    destb = (uint8_t *)dest + n;
+    while (n--) {
+        *(--destb) = *(--srcb);
+    }
+
+    return dest;
+}
+
 /*
  * fill memory with a constant byte
  */
@@ -119,3 +142,19 @@ strchr(const char *str, int c)
 
     return NULL;
 }
+
+/*
+ * compute a 32-bit FNV-1a hash of a string
+ */
+uint32_t
+strhash(const char *s)
+{
+    uint32_t h = 0x811c9dc5;
+
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 0x01000193;
+    }
+
+    return h;
+}
@@ -323,9 +323,15 @@ isr_common:
   mov [rsp+0x68], r14
   mov [rsp+0x70], r15
 
+  ; keep the interrupt number on the stack, handlers may enable nested
+  ; interrupts which overwrite current_interrupt
+
+  mov rax, [current_interrupt]
+  mov [rsp+0x78], rax
+
   ; call interrupt handler
 
-  mov rdi, [current_interrupt]
+  mov rdi, [rsp+0x78]
   mov rsi, rsp
   add rsi, 0x100
   mov rdx, rsp
@@ -334,7 +340,7 @@ isr_common:
 
   ; handle end-of-interrupt command
 
-  mov rax, [current_interrupt]
+  mov rax, [rsp+0x78]
 
   cmp rax, GATE_EXC_COUNT
   jb .skip_eoi
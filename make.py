@@ -13,6 +13,9 @@ import copy
 import glob
 import inspect
 import os
+import re
+import shlex
+import subprocess
 import sys
 import time
 
@@ -77,6 +80,31 @@ def run(cmd, ignore_error = False):
     if ret != 0 and not ignore_error:
         sys.exit('command failed')
 
+def boot_time(marker, timeout=60):
+    """Boot the disk image in QEMU and return seconds until marker appears on serial and its line"""
+
+    cmd = expand("{QEMU} -drive file={DISK_IMAGE},format=raw,if=virtio -m 64 -display none -serial stdio")
+    print(cmd)
+
+    start = time.time()
+    proc = subprocess.Popen(shlex.split(cmd), stdout=subprocess.PIPE)
+    elapsed = None
+    found = None
+
+    try:
+        for line in proc.stdout:
+            if marker.encode() in line:
+                elapsed = time.time() - start
+                found = line.decode(errors='replace')
+                break
+            if time.time() - start > timeout:
+                break
+    finally:
+        proc.kill()
+        proc.wait()
+
+    return elapsed, found
+
 # task handlers
 
 def task_clean():
@@ -159,8 +187,9 @@ def task_fs_images():
     """Build apps/data filesystem images"""
 
     makedir("{BUILD_DIR}")
-    run("genromfs -d {BASE_DIR}/apps -f {BUILD_DIR}/apps.img")
-    run("genromfs -d {BASE_DIR}/data -f {BUILD_DIR}/data.img")
+    run("{MKROMFS} -a {ROMFS_ALIGN} -V apps {BASE_DIR}/apps {BUILD_DIR}/apps.img")
+    run("{MKROMFS} -a {ROMFS_ALIGN} -z {ROMFS_COMPRESS} -V data "
+        "{BASE_DIR}/data {BUILD_DIR}/data.img")
 
 def task_disk_image():
     """Build disk image"""
@@ -219,6 +248,33 @@ def task_install():
     # unmount filesystem
     run('sudo umount "{MOUNT_DIR}"')
 
+def task_fs_bench():
+    """Compare boot time, image size and guest memory of raw and compressed data images
+
+    heap and free memory are reported by the guest with the boot line. free
+    memory is counted in whole frames and includes the loaded images and the
+    static romfs block cache, which both kernels carry.
+    """
+
+    results = []
+    compress = config['ROMFS_COMPRESS'] or 65536
+
+    for name, size in (('raw', 0), ('compressed', compress)):
+        config['ROMFS_COMPRESS'] = size
+        task_install()
+        image = os.path.getsize(expand("{BUILD_DIR}/data.img"))
+        secs, line = boot_time("boot completed")
+        mem = re.search(r"(\d+) KiB heap, (\d+) KiB free", line or "")
+        heap, free = (int(mem.group(1)), int(mem.group(2))) if mem else (None, None)
+        results.append((name, image, heap, free, secs))
+
+    print("%-12s %12s %12s %12s %12s" % ("image", "size (KiB)", "heap (KiB)", "free (KiB)", "boot (s)"))
+    for name, image, heap, free, secs in results:
+        heap = "%d" % heap if heap is not None else "-"
+        free = "%d" % free if free is not None else "-"
+        secs = "%.2f" % secs if secs is not None else "timeout"
+        print("%-12s %12d %12s %12s %12s" % (name, image >> 10, heap, free, secs))
+
 def task_qemu():
     """Launch in QEMU"""
 
@@ -226,7 +282,7 @@ def task_qemu():
     task_install()
 
     # launch qemu
-    run("{QEMU} -hda {DISK_IMAGE} -m 64")
+    run("{QEMU} -drive file={DISK_IMAGE},format=raw,if=virtio -m 64")
 
 def task_bochs():
     """Launch in Bochs"""
@@ -0,0 +1,323 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2015 Łukasz S.
+# Distributed under the terms of GPL-2 License.
+#
+
+"""
+romfs image builder
+
+Produces images readable by any romfs driver, with two extensions used
+by the os64 kernel:
+
+  - data of regular files at least one page long is aligned to a page
+    boundary (relative to the image start, GRUB loads modules page-aligned),
+    so large assets can be accessed in place
+
+  - the data area of every directory header holds a hash table of its
+    entries, so names can be found without walking the sibling chain
+
+  - optionally, large files are split into blocks compressed with LZ4,
+    marked with the RLZ4 magic in the spec.info field of the header
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+# inode types
+IN_HLINK = 0
+IN_DIR = 1
+IN_REG = 2
+IN_EXEC = 8
+
+# magic number of the directory hash table ('RHT1')
+HASH_MAGIC = 0x52485431
+
+# magic number of compressed files ('RLZ4')
+LZ4_MAGIC = 0x524c5a34
+
+# helpers
+
+def align(x, a):
+    """Round x up to a multiple of a"""
+
+    return (x + a - 1) & ~(a - 1)
+
+def pad16(b):
+    """Pad bytes with zeros to a 16-byte boundary"""
+
+    return b + b'\0' * (align(len(b), 16) - len(b))
+
+def strhash(name):
+    """Compute a 32-bit FNV-1a hash of a name (same as libc strhash)"""
+
+    h = 0x811c9dc5
+    for c in name:
+        h = ((h ^ c) * 0x01000193) & 0xffffffff
+    return h
+
+def cksum(b):
+    """Return a value which makes big-endian 32-bit words of b sum to zero"""
+
+    words = struct.unpack('>%dI' % (len(b) // 4), b)
+    return -sum(words) & 0xffffffff
+
+# lz4 compression
+
+def lz4_length(out, n):
+    """Append an extended LZ4 length field"""
+
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+def lz4_sequence(out, lit, offset, mlen):
+    """Append a single LZ4 sequence (the last one has no match)"""
+
+    token = min(len(lit), 15) << 4
+    if mlen:
+        token |= min(mlen - 4, 15)
+
+    out.append(token)
+    if len(lit) >= 15:
+        lz4_length(out, len(lit) - 15)
+    out += lit
+
+    if mlen:
+        out += struct.pack('<H', offset)
+        if mlen - 4 >= 15:
+            lz4_length(out, mlen - 4 - 15)
+
+def lz4_compress(src):
+    """Compress bytes into a single LZ4 block using greedy matching"""
+
+    n = len(src)
+    out = bytearray()
+    table = {}
+    anchor = 0
+    i = 0
+
+    # the last match must start 12 bytes and end 5 bytes before the end
+    while i < n - 12:
+        key = src[i:i + 4]
+        ref = table.get(key, -1)
+        table[key] = i
+
+        if ref < 0 or i - ref > 0xffff:
+            i += 1
+            continue
+
+        mlen = 4
+        while mlen < n - 5 - i and src[ref + mlen] == src[i + mlen]:
+            mlen += 1
+
+        lz4_sequence(out, src[anchor:i], i - ref, mlen)
+        i += mlen
+        anchor = i
+
+    lz4_sequence(out, src[anchor:], 0, 0)
+
+    return bytes(out)
+
+def compress(data, block_size):
+    """
+    Split data into blocks and compress each of them. Blocks which don't
+    shrink are stored as is, the reader tells them apart by their length.
+    """
+
+    blocks = []
+    for i in range(0, len(data), block_size):
+        raw = data[i:i + block_size]
+        packed = lz4_compress(raw)
+        blocks.append(packed if len(packed) < len(raw) else raw)
+
+    count = len(blocks)
+    offsets = [12 + 4 * (count + 1)]
+    for b in blocks:
+        offsets.append(offsets[-1] + len(b))
+
+    hdr = struct.pack('>III', block_size, len(data), count)
+    hdr += struct.pack('>%dI' % len(offsets), *offsets)
+
+    return hdr + b''.join(blocks)
+
+# image layout
+
+class Node:
+    """Single file header in the image"""
+
+    def __init__(self, name, type, data=b''):
+        self.name = name.encode()
+        self.type = type
+        self.data = data
+        self.spec = 0
+        self.offset = 0
+        self.next = 0
+        self.children = []
+
+    def header_len(self):
+        return 16 + len(pad16(self.name + b'\0'))
+
+def load_tree(path, name, zmin, zblock):
+    """Build a directory node with its dot entries and children"""
+
+    node = Node(name, IN_DIR)
+    node.children.append(Node('.', IN_HLINK))
+    node.children.append(Node('..', IN_HLINK))
+
+    for entry in sorted(os.listdir(path)):
+        full = os.path.join(path, entry)
+        if os.path.isdir(full):
+            node.children.append(load_tree(full, entry, zmin, zblock))
+        elif os.path.isfile(full):
+            child = Node(entry, IN_REG, open(full, 'rb').read())
+            if os.access(full, os.X_OK):
+                child.type |= IN_EXEC
+            if zmin and len(child.data) >= zmin:
+                packed = compress(child.data, zblock)
+                if len(packed) < len(child.data):
+                    child.data = packed
+                    child.spec = LZ4_MAGIC
+            node.children.append(child)
+
+    return node
+
+def hash_table_len(node):
+    """Return size of the hash table stored in a directory header"""
+
+    count = len(node.children) - 2
+    return 12 + 4 * (hash_bucket_count(count) + 1) + 4 * count
+
+def hash_bucket_count(count):
+    """Return amount of hash buckets for a given amount of entries"""
+
+    n = 1
+    while n < count:
+        n <<= 1
+    return n
+
+def place(node, pos, page_size, data_len):
+    """Return the offset of a header whose data is data_len bytes long"""
+
+    if node.type & 7 == IN_REG and not node.spec and data_len >= page_size:
+        while (pos + node.header_len()) % page_size:
+            pos += 16
+    return pos
+
+def layout(dirnode, hdrnode, parent, pos, page_size):
+    """
+    Assign offsets to the children of a directory. hdrnode is the header
+    which carries the hash table (the root '.' or the named subdirectory),
+    parent is the header of the parent directory. Return the next free offset.
+    """
+
+    for node in dirnode.children:
+        if node.name == b'.' and hdrnode is None:
+            # root directory, '.' acts as the directory header
+            node.type = IN_DIR
+            node.data = b'\0' * hash_table_len(dirnode)
+            hdrnode = node
+            parent = node
+
+        pos = place(node, pos, page_size, len(node.data))
+        node.offset = pos
+        pos += node.header_len() + len(pad16(node.data))
+
+        if node.type & 7 == IN_DIR and node is not hdrnode:
+            node.data = b'\0' * hash_table_len(node)
+            pos += len(pad16(node.data))
+            pos = layout(node, node, hdrnode, pos, page_size)
+
+    # link siblings and dot entries
+    for prev, node in zip(dirnode.children, dirnode.children[1:]):
+        prev.next = node.offset
+    dirnode.children[0].spec = hdrnode.offset
+    dirnode.children[1].spec = parent.offset
+    hdrnode.spec = dirnode.children[0].offset
+    hdrnode.data = hash_table(dirnode.children[2:])
+
+    return pos
+
+def hash_table(entries):
+    """Serialize a hash table of the given directory entries"""
+
+    nbuckets = hash_bucket_count(len(entries))
+    buckets = [[] for i in range(nbuckets)]
+    for node in entries:
+        buckets[strhash(node.name) & (nbuckets - 1)].append(node.offset)
+
+    starts = [0]
+    for b in buckets:
+        starts.append(starts[-1] + len(b))
+
+    table = struct.pack('>III', HASH_MAGIC, nbuckets, len(entries))
+    table += struct.pack('>%dI' % len(starts), *starts)
+    for b in buckets:
+        table += struct.pack('>%dI' % len(b), *b)
+
+    return table
+
+def serialize(node, image):
+    """Write a header with its data and all children into the image"""
+
+    hdr = struct.pack('>IIII', node.next | node.type, node.spec, len(node.data), 0)
+    hdr += pad16(node.name + b'\0')
+    hdr = hdr[:12] + struct.pack('>I', cksum(hdr)) + hdr[16:]
+
+    end = node.offset + len(hdr)
+    image[node.offset:end] = hdr
+    image[end:end + len(node.data)] = node.data
+
+    for child in node.children:
+        serialize(child, image)
+
+def build(srcdir, volume, page_size, zmin, zblock):
+    """Return image bytes for a given source directory"""
+
+    root = load_tree(srcdir, '', zmin, zblock)
+
+    sb_len = 16 + len(pad16(volume.encode() + b'\0'))
+    size = align(layout(root, None, None, sb_len, page_size), 1024)
+
+    image = bytearray(size)
+    for node in root.children:
+        serialize(node, image)
+
+    sb = b'-rom1fs-' + struct.pack('>II', size, 0) + pad16(volume.encode() + b'\0')
+    image[0:len(sb)] = sb
+    image[12:16] = struct.pack('>I', cksum(bytes(image[0:min(512, size)])))
+
+    return bytes(image)
+
+# entry point
+
+def main():
+    """Execute application"""
+
+    parser = argparse.ArgumentParser(description="romfs image builder")
+    parser.add_argument('-a', '--align', type=int, default=4096,
+                        help='alignment of regular file data (default: 4096)')
+    parser.add_argument('-V', '--volume', default='rom',
+                        help='volume name (default: rom)')
+    parser.add_argument('-z', '--compress', type=int, default=0, metavar='SIZE',
+                        help='compress files of at least SIZE bytes (default: off)')
+    parser.add_argument('-b', '--block', type=int, default=32768,
+                        help='block size of compressed files (default: 32768)')
+    parser.add_argument('srcdir', help='source directory')
+    parser.add_argument('image', help='output image')
+    args = parser.parse_args()
+
+    if args.align < 16 or args.align & (args.align - 1):
+        sys.exit('alignment must be a power of two, at least 16')
+
+    if args.block < 16 or args.block > 32768:
+        sys.exit('block size must be between 16 and 32768')
+
+    image = build(args.srcdir, args.volume, args.align, args.compress, args.block)
+    open(args.image, 'wb').write(image)
+
+if __name__ == '__main__':
+    main()